@@ -0,0 +1,166 @@
+//
+// TSC clock and per-CPU timers.
+//
+// clockinit(), called from the first process's forkret() before any
+// user code runs, measures the TSC frequency against PIT channel 2
+// and fills in the page that every address space maps read-only at
+// CLOCKVA (see clock.h and kmap[] in vm.c).
+//
+// nsleep() sleeps with nanosecond resolution. Each CPU keeps its
+// own queue of sleepers sorted by deadline, checked on its own timer
+// interrupt without tickslock. A sleeper is woken on the last tick
+// before its deadline and spins for the rest, which is less than a
+// tick; timer interrupts still preempt it.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "clock.h"
+
+#define PIT_HZ  1193182
+#define CALMS   10        // Calibration time, in ms
+
+// Mapped at CLOCKVA; a page of its own, so nothing else leaks.
+char clockpage[PGSIZE] __attribute__((aligned(PGSIZE)));
+#define CP ((struct clockpage*)clockpage)
+
+// A sleeping nsleep(). Lives on the sleeper's kernel stack.
+struct timer {
+  unsigned long long deadline;  // clockns() to return at
+  int fired;
+  struct timer *next;
+};
+
+static struct timerq {
+  struct spinlock lock;
+  struct timer *head;           // Sorted by deadline
+  unsigned long long last;      // clockns() at the last tick
+  unsigned long long period;    // Between the last two ticks
+} timerq[NCPU];
+
+// n / d, for a quotient that fits in 32 bits.
+static uint
+div64(unsigned long long n, uint d)
+{
+  uint q, r;
+
+  asm("divl %4" : "=a" (q), "=d" (r) : "a" ((uint)n), "d" ((uint)(n >> 32)), "rm" (d));
+  return q;
+}
+
+void
+clockinit(void)
+{
+  unsigned long long t0, t1;
+  int i;
+
+  for(i = 0; i < NCPU; i++)
+    initlock(&timerq[i].lock, "timerq");
+
+  // Count down CALMS ms on PIT channel 2, gated on with the speaker
+  // off, and see how far the TSC gets meanwhile. No interrupts, so
+  // that nothing else runs in between.
+  pushcli();
+  outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+  outb(0x43, 0xB0);  // Channel 2, lobyte/hibyte, mode 0
+  outb(0x42, (PIT_HZ / 1000 * CALMS) & 0xFF);
+  outb(0x42, (PIT_HZ / 1000 * CALMS) >> 8);
+  t0 = readtsc();
+  while((inb(0x61) & 0x20) == 0)
+    ;
+  t1 = readtsc();
+  popcli();
+
+  CP->khz = (uint)(t1 - t0) / CALMS;
+  if(CP->khz < 1000)
+    panic("clockinit");
+  CP->tsc0 = t0;
+  __sync_synchronize();
+  CP->mult = div64(1000000ULL << CLOCKSHIFT, CP->khz);  // Last: clocktick() checks it
+  cprintf("TSC at %d MHz\n", CP->khz / 1000);
+}
+
+// Called on every CPU's timer interrupt.
+void
+clocktick(void)
+{
+  struct timerq *tq = &timerq[cpuid()];
+  unsigned long long now;
+  struct timer *t;
+
+  if(CP->mult == 0)
+    return;  // Not calibrated yet
+  now = clockns(CP);
+  acquire(&tq->lock);
+  if(tq->last)
+    tq->period = now - tq->last;
+  tq->last = now;
+  while((t = tq->head) != 0 && t->deadline <= now + tq->period){
+    tq->head = t->next;
+    t->fired = 1;
+    wakeup(t);
+  }
+  release(&tq->lock);
+}
+
+// Sleep for ns nanoseconds. Returns -1 if killed meanwhile.
+int
+nsleep(uint ns)
+{
+  struct proc *p = myproc();
+  struct timerq *tq;
+  struct timer t, **pp;
+
+  t.deadline = clockns(CP) + ns;
+  t.fired = 0;
+  pushcli();
+  tq = &timerq[cpuid()];
+  acquire(&tq->lock);
+  popcli();
+  if(t.deadline > clockns(CP) + tq->period){
+    for(pp = &tq->head; *pp && (*pp)->deadline <= t.deadline; pp = &(*pp)->next)
+      ;
+    t.next = *pp;
+    *pp = &t;
+    while(!t.fired && !p->killed)
+      sleep(&t, &tq->lock);
+    if(!t.fired){
+      for(pp = &tq->head; *pp != &t; pp = &(*pp)->next)
+        ;
+      *pp = t.next;
+    }
+  }
+  release(&tq->lock);
+  if(p->killed)
+    return -1;
+  while(clockns(CP) < t.deadline)
+    asm volatile("pause");
+  return 0;
+}
+
+int
+sys_nanotime(void)
+{
+  unsigned long long *ns;
+
+  if(argptr(0, (char**)&ns, sizeof(*ns)) < 0)
+    return -1;
+  *ns = clockns(CP);
+  return 0;
+}
+
+int
+sys_nsleep(void)
+{
+  int ns;
+
+  if(argint(0, &ns) < 0 || ns < 0)
+    return -1;
+  return nsleep(ns);
+}
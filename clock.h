@@ -0,0 +1,32 @@
+// High-resolution monotonic clock. The kernel calibrates the TSC at
+// boot and maps this page read-only at CLOCKVA in every address
+// space, so user programs can read the time with clockns() without
+// a system call. nanotime() returns the same value.
+struct clockpage {
+  unsigned long long tsc0;  // TSC at calibration, early in boot
+  uint mult;                // ns = (tsc - tsc0) * mult >> CLOCKSHIFT
+  uint khz;                 // TSC frequency
+};
+
+#define CLOCKVA     0xFD000000  // Between kernel memory and DEVSPACE
+#define CLOCKSHIFT  22
+
+static inline unsigned long long
+readtsc(void)
+{
+  unsigned long long t;
+
+  asm volatile("rdtsc" : "=A" (t));
+  return t;
+}
+
+// Nanoseconds since calibration. Assumes the CPUs' TSCs run in step.
+static inline unsigned long long
+clockns(struct clockpage *cp)
+{
+  unsigned long long t = readtsc() - cp->tsc0;
+
+  // 64 by 32 bit product without overflow or a libgcc call.
+  return ((t >> 32) * cp->mult << (32 - CLOCKSHIFT)) +
+         ((t & 0xFFFFFFFF) * cp->mult >> CLOCKSHIFT);
+}
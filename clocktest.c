@@ -0,0 +1,71 @@
+// Check the TSC clock: it must never go backwards, it must agree
+// with uptime() over a second, and reading it from the clock page
+// should be much cheaper than nanotime(). Then see how close
+// nsleep() gets to a few sleep lengths.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "clock.h"
+
+#define NREAD 100000
+
+static struct clockpage *cp = (struct clockpage*)CLOCKVA;
+
+static uint
+since(unsigned long long t0)
+{
+  return clockns(cp) - t0;
+}
+
+int
+main(void)
+{
+  static uint lens[] = { 10000, 100000, 1000000, 25000000 };
+  unsigned long long t0, t1, last;
+  uint ms, i;
+  int u0, fail = 0;
+
+  printf(1, "TSC at %d MHz\n", cp->khz / 1000);
+
+  last = 0;
+  t0 = clockns(cp);
+  for(i = 0; i < NREAD; i++){
+    t1 = clockns(cp);
+    if(t1 < last){
+      printf(1, "clocktest: clock went backwards\n");
+      fail = 1;
+    }
+    last = t1;
+  }
+  printf(1, "clock page: %d ns per read\n", since(t0) / NREAD);
+  t0 = clockns(cp);
+  for(i = 0; i < NREAD; i++)
+    nanotime(&t1);
+  printf(1, "nanotime(): %d ns per call\n", since(t0) / NREAD);
+
+  u0 = uptime();
+  while(uptime() == u0)
+    ;
+  t0 = clockns(cp);
+  sleep(100);
+  ms = since(t0) / 1000000;
+  printf(1, "100 ticks: %d ms\n", ms);
+  if(ms < 900 || ms > 1100){
+    printf(1, "clocktest: clock disagrees with uptime()\n");
+    fail = 1;
+  }
+
+  for(i = 0; i < sizeof(lens) / sizeof(lens[0]); i++){
+    t0 = clockns(cp);
+    nsleep(lens[i]);
+    t1 = clockns(cp) - t0;
+    printf(1, "nsleep(%d): %d ns\n", lens[i], (uint)t1);
+    if(t1 < lens[i]){
+      printf(1, "clocktest: nsleep() returned early\n");
+      fail = 1;
+    }
+  }
+  printf(1, fail ? "clocktest FAILED\n" : "clocktest ok\n");
+  exit();
+}
@@ -2,13 +2,18 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct memstat;
+struct mmap_area;
 struct pipe;
 struct proc;
+struct procstat;
 struct rtcdate;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct tlbgather;
+struct vmspace;
 
 // bio.c
 void            binit(void);
@@ -16,6 +21,12 @@ struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
 
+// clock.c
+extern char     clockpage[];
+void            clockinit(void);
+void            clocktick(void);
+int             nsleep(uint);
+
 // console.c
 void            consoleinit(void);
 void            cprintf(char*, ...);
@@ -30,6 +41,7 @@ struct file*    filealloc(void);
 void            fileclose(struct file*);
 struct file*    filedup(struct file*);
 void            fileinit(void);
+void            fileput(struct file*);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
@@ -53,6 +65,11 @@ int             readi(struct inode*, char*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, char*, uint, uint);
 
+// futex.c
+void            futexinit(void);
+int             futex_wait(uint, int);
+int             futex_wake(uint, int);
+
 // ide.c
 void            ideinit(void);
 void            ideintr(void);
@@ -63,11 +80,17 @@ void            ioapicenable(int irq, int cpu);
 extern uchar    ioapicid;
 void            ioapicinit(void);
 
+// ksm.c
+void            ksminit(void);
+void            ksmstat(struct memstat*);
+
 // kalloc.c
 char*           kalloc(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
+void            kdup(char*);
+void            kpin(int);
 
 // kbd.c
 void            kbdintr(void);
@@ -103,18 +126,27 @@ int             pipewrite(struct pipe*, char*, int);
 
 //PAGEBREAK: 16
 // proc.c
+int             clone(void (*)(void*), void*, void*);
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
+int             getprocstats(int, struct procstat*);
 int             growproc(int);
+int             kthread(char*, void (*)(void));
 int             kill(int);
 struct cpu*     mycpu(void);
 struct proc*    myproc();
 void            pinit(void);
+void            preempt(void);
 void            procdump(void);
+int             procscan(int (*)(struct proc*, void*), void*, int);
 void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
+int             schedtick(void);
 void            setproc(struct proc*);
+int             setquantum(int);
+int             setaffinity(int, uint);
+int             setsched(int);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
 int             wait(void);
@@ -122,9 +154,24 @@ void            wakeup(void*);
 void            yield(void);
 int 			nice(int);
 
+// writeback.c
+void            wbinit(void);
+void            wbwait(struct inode*);
+void            wbdirty(void);
+void            mmap_writeback(struct proc*, struct mmap_area*, uint, uint, int);
+
 // swtch.S
 void            swtch(struct context**, struct context*);
 
+// ring.c
+void            ringinit(void);
+
+// shm.c
+void            shminit(void);
+int             shmopen(int, int, int);
+int             shmmap(int, uint, int);
+int             shmunlink(int);
+
 // spinlock.c
 void            acquire(struct spinlock*);
 void            getcallerpcs(void*, uint*);
@@ -160,6 +207,16 @@ void            syscall(void);
 // timer.c
 void            timerinit(void);
 
+// tlb.c
+#define T_TLBFLUSH      (T_IRQ0 + 24)  // TLB shootdown IPI
+#define T_WAKEUP        (T_IRQ0 + 25)  // Wake an idle CPU (see proc.c)
+void            lapicipi(int, int);
+void            tlbdrain(struct proc*);
+void            tlbflush(struct proc*);
+void            tlbintr(void);
+void            tlbshoot(struct proc*);
+void            tlbunmap(struct proc*, uint, uint);
+
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
@@ -178,6 +235,7 @@ pde_t*          setupkvm(void);
 char*           uva2ka(pde_t*, char*);
 int             allocuvm(pde_t*, uint, uint);
 int             deallocuvm(pde_t*, uint, uint);
+uint            gatheruvm(struct tlbgather*, pde_t*, uint, uint);
 void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
@@ -186,6 +244,7 @@ void            switchuvm(struct proc*);
 void            switchkvm(void);
 int             copyout(pde_t*, uint, void*, uint);
 void            clearpteu(pde_t *pgdir, char *uva);
+void            flushpage(uint);
 
 // swap.c
 void swapread(char* ptr, int blkno);
@@ -196,4 +255,6 @@ void swapwrite(char* ptr, int blkno);
 
 // PA3
 int munmap(void* addr, int length);
+int mmapfork(struct proc *np, struct proc *p);
+int mmap_pages(uint addr, char **pages, int n, int prot);
 extern int pageframe_counters[];
\ No newline at end of file
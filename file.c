@@ -12,6 +12,7 @@
 
 #include "mmu.h"
 #include "proc.h"
+#include "vmspace.h"
 #include "memlayout.h"
 
 struct devsw devsw[NDEV];
@@ -60,23 +61,34 @@ filedup(struct file *f)
 void
 fileclose(struct file *f)
 {
-  struct file ff;
   struct proc *p = myproc();
 
   // Go through mmaps. Find if a mmap has this file open.
   // pdf: "When a file descriptor closes, its mmap’ed areas are unmaped"
+  acquiresleep(&p->vm->lock);
   for (int i = 0; i < MAX_MMAPS_PROC; i++)
   {
     // If found a mmap with this file open, munmap it.
-    if (p->mmaps[i].file == f)
+    if (p->vm->mmaps[i].used && p->vm->mmaps[i].file == f)
     {
-      munmap((void*)p->mmaps[i].addr, p->mmaps[i].length);
+      munmap((void*)p->vm->mmaps[i].addr, p->vm->mmaps[i].length);
     }
   }
+  releasesleep(&p->vm->lock);
+
+  fileput(f);
+}
+
+// Drop a reference to file f without touching mmaps.
+// Used by munmap() and by exiting threads.
+void
+fileput(struct file *f)
+{
+  struct file ff;
 
   acquire(&ftable.lock);
   if(f->ref < 1)
-    panic("fileclose");
+    panic("fileput");
   if(--f->ref > 0){
     release(&ftable.lock);
     return;
@@ -0,0 +1,68 @@
+// fork()/exit()/wait() throughput with 0, a quarter and half of
+// the process table taken by idle processes. The rate should not
+// drop as the table fills.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+
+#define NFORK 2000
+
+// Start n processes that block until fd is closed.
+static int
+idlers(int n, int fds[2])
+{
+  char c;
+  int i, pid;
+
+  if(pipe(fds) < 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    if((pid = fork()) < 0)
+      return -1;
+    if(pid == 0){
+      close(fds[1]);
+      read(fds[0], &c, 1);
+      exit();
+    }
+  }
+  close(fds[0]);
+  return 0;
+}
+
+static int
+forks(void)
+{
+  int i, pid, t0;
+
+  t0 = uptime();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0){
+      printf(1, "forkbench: fork failed\n");
+      exit();
+    }
+    if(pid == 0)
+      exit();
+    wait();
+  }
+  return uptime() - t0;
+}
+
+int
+main(void)
+{
+  int fds[2], n;
+
+  for(n = 0; n <= NPROC / 2; n += NPROC / 4){
+    if(idlers(n, fds) < 0){
+      printf(1, "forkbench: can't start %d idle processes\n", n);
+      exit();
+    }
+    printf(1, "%d idle: %d forks in %d ticks\n", n, NFORK, forks());
+    close(fds[1]);  // Let the idlers go
+    while(wait() >= 0)
+      ;
+  }
+  exit();
+}
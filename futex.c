@@ -0,0 +1,157 @@
+//
+// Futexes: sleep until another process changes a word of memory.
+//
+// futex_wait(addr, val) sleeps if *addr still equals val, and
+// futex_wake(addr, n) wakes up to n processes sleeping on addr.
+// Waiters are keyed by the physical address of the word, so
+// processes that map the same page at different addresses (shared
+// mappings, shm segments) meet on the same key. A word in a
+// copy-on-write page changes key when the page is copied.
+//
+// Each hash bucket has its own lock and list of waiters, so
+// unrelated futexes rarely contend, and futex_wake() doesn't have
+// to look at every process as wakeup() does.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
+
+#define NFUTEXHASH 64
+
+// A sleeping futex_wait(). Lives on the waiter's kernel stack.
+struct fwaiter {
+  uint pa;                 // Physical address of the word
+  int woken;
+  struct fwaiter *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct fwaiter *head;
+} futextab[NFUTEXHASH];
+
+void
+futexinit(void)
+{
+  int i;
+
+  for(i = 0; i < NFUTEXHASH; i++)
+    initlock(&futextab[i].lock, "futex");
+}
+
+// Physical address of the user word at addr, which argptr()
+// checked, or -1 if its page isn't mapped and readable. The word
+// isn't touched: a kernel-mode fault that trap() refuses (e.g. on a
+// PROT_NONE page) would repeat forever. Callers have just used the
+// word from user space, so its page is normally mapped.
+static uint
+futexaddr(uint addr)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  uint pa = -1;
+
+  if(addr % 4 != 0)
+    return -1;
+  acquire(&p->vm->ptlock);
+  if((pte = walkpgdir2(p->pgdir, (void*)addr, 0)) != 0 &&
+     (*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U))
+    pa = PTE_ADDR(*pte) | (addr & (PGSIZE - 1));
+  release(&p->vm->ptlock);
+  return pa;
+}
+
+static int
+futexhash(uint pa)
+{
+  return (pa >> 2) % NFUTEXHASH;
+}
+
+int
+futex_wait(uint addr, int val)
+{
+  struct proc *p = myproc();
+  struct fwaiter w, **pp;
+  uint pa;
+  int h;
+
+  if((pa = futexaddr(addr)) == -1)
+    return -1;
+  h = futexhash(pa);
+  acquire(&futextab[h].lock);
+  // Compare under the bucket lock, which futex_wake() takes too,
+  // so a change and wake between here and sleep() isn't lost.
+  // Read through the kernel address: no fault while holding a lock.
+  if(*(int*)P2V(pa) != val){
+    release(&futextab[h].lock);
+    return -1;
+  }
+  w.pa = pa;
+  w.woken = 0;
+  w.next = futextab[h].head;
+  futextab[h].head = &w;
+  while(!w.woken && !p->killed)
+    sleep(&w, &futextab[h].lock);
+  if(!w.woken){
+    for(pp = &futextab[h].head; *pp != &w; pp = &(*pp)->next)
+      ;
+    *pp = w.next;
+  }
+  release(&futextab[h].lock);
+  return w.woken ? 0 : -1;
+}
+
+// Wake up to n waiters on addr. Returns the number woken.
+int
+futex_wake(uint addr, int n)
+{
+  struct fwaiter *w, **pp;
+  uint pa;
+  int h, woken = 0;
+
+  if((pa = futexaddr(addr)) == -1)
+    return -1;
+  h = futexhash(pa);
+  acquire(&futextab[h].lock);
+  for(pp = &futextab[h].head; (w = *pp) != 0 && woken < n; ){
+    if(w->pa != pa){
+      pp = &w->next;
+      continue;
+    }
+    *pp = w->next;
+    w->woken = 1;
+    wakeup(w);
+    woken++;
+  }
+  release(&futextab[h].lock);
+  return woken;
+}
+
+int
+sys_futex_wait(void)
+{
+  char *addr;
+  int val;
+
+  if(argptr(0, &addr, 4) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait((uint)addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  char *addr;
+  int n;
+
+  if(argptr(0, &addr, 4) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake((uint)addr, n);
+}
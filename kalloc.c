@@ -14,6 +14,7 @@ extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
 static int frees = 0;
+static int locked = 0;  // Pages with PTE_LOCK set
 
 struct run {
   struct run *next;
@@ -78,6 +79,11 @@ kfree(char *v)
   // Get counter index
   int i = ((uint)v - KERNBASE) / PGSIZE;
 
+  // The counter is also changed by kdup() from other CPUs,
+  // so update it under the lock.
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+
   // Decrease counter when kfree is called
   // If counter = 0, don't decrease it. 
   if(pageframe_counters[i] != 0)
@@ -94,15 +100,28 @@ kfree(char *v)
     // Fill with junk to catch dangling refs.
     memset(v, 1, PGSIZE);
 
-    if(kmem.use_lock)
-      acquire(&kmem.lock);
     r = (struct run*)v;
     r->next = kmem.freelist;
     kmem.freelist = r;
     frees++;
-    if(kmem.use_lock)
-      release(&kmem.lock);
   }
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Take another reference to the page at v, so that it
+// survives the next kfree() of it.
+void
+kdup(char *v)
+{
+  if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
+    panic("kdup");
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  pageframe_counters[V2P(v) / PGSIZE]++;
+  if(kmem.use_lock)
+    release(&kmem.lock);
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -111,6 +130,7 @@ kfree(char *v)
 
 #include "proc.h"
 #include "x86.h"
+#include "memstat.h"
 
 char*
 kalloc(void)
@@ -138,3 +158,29 @@ int sys_frees(void)
 {
 	return frees;
 }
+
+// n more (or, if negative, fewer) pages are locked by mlock().
+void
+kpin(int n)
+{
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  locked += n;
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+int sys_memstat(void)
+{
+	struct memstat *m, s;
+	if ( argptr(0, (char**)&m, sizeof(*m)) < 0 )
+		return -1;
+	// Fill a copy: writing m may fault into kalloc().
+	acquire(&kmem.lock);
+	s.frees = frees;
+	s.locked = locked;
+	release(&kmem.lock);
+	ksmstat(&s);
+	*m = s;
+	return 0;
+}
@@ -0,0 +1,307 @@
+//
+// Kernel same-page merging.
+//
+// A process that calls ksm(1) lets the ksmd kernel thread merge its
+// anonymous pages (the heap and private anonymous mappings) with
+// byte-identical pages of other such processes, or of its own. A
+// merged page is mapped read-only with PTE_COW, exactly as fork()
+// leaves pages, so the first write to it gets a private copy from
+// trap(). pageframe_counters counts the sharers.
+//
+// Every KSMPERIOD ticks ksmd hashes up to KSMPAGES pages of each
+// process. A page whose hash and contents match a stable frame is
+// mapped to that frame. Otherwise it is compared with the pages
+// seen earlier in the same round; on a match the earlier page
+// becomes a stable frame. ksmd holds a reference on each stable
+// frame, so no sharer's write can reach it, and drops the frame
+// once it is the only user left.
+//
+// The scan holds ptable.lock, which stops all scheduling, so it lets
+// go of it after every KSMBATCH pages. A page seen earlier is then
+// looked up again before it is used, since its process may have run
+// and changed its page table in between.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
+#include "memstat.h"
+
+#define MAP_PRIVATE 0x10
+
+#define KSMPERIOD 100   // ticks between rounds
+#define KSMPAGES  32    // pages hashed per process and round
+#define NKSM      128   // maximum number of stable frames
+#define NKSMSEEN  (KSMPAGES * 4)  // unmatched pages remembered per round
+#define KSMBATCH  8     // pages hashed per hold of ptable.lock
+
+struct ksmframe {
+  uint hash;
+  char *page;       // Kernel address, or 0 if unused
+};
+
+struct ksmseen {
+  uint hash;
+  struct proc *p;   // Where the page is mapped
+  int pid;          // p's pid then; p may have exited since
+  uint va;
+};
+
+static struct ksmframe stable[NKSM];
+
+// Written by ksmd only.
+static int merged;  // Pages mapped to a stable frame so far
+static int nstable; // Stable frames held
+
+// State of one round, passed to ksmscan().
+struct ksmround {
+  struct ksmseen seen[NKSMSEEN];
+  int nseen;
+  int pid;          // Process being scanned
+  int n;            // Pages of it looked at so far
+};
+
+static uint
+ksmhash(char *page)
+{
+  uint *w = (uint*)page;
+  uint h = 0;
+  int i;
+
+  for(i = 0; i < PGSIZE/4; i++)
+    h = h * 31 + w[i];
+  return h;
+}
+
+// Next address at or above va that may be merged in p, or -1.
+static uint
+ksmnext(struct proc *p, uint va)
+{
+  struct mmap_area *ma, *best = 0;
+
+  if(va < p->sz)
+    return va;
+  for(ma = p->vm->mmaps; ma < &p->vm->mmaps[MAX_MMAPS_PROC]; ma++){
+    if(!ma->used || ma->file || !(ma->flags & MAP_PRIVATE))
+      continue;
+    if(ma->addr + ma->length > va && (best == 0 || ma->addr < best->addr))
+      best = ma;
+  }
+  if(best == 0)
+    return -1;
+  return va > best->addr ? va : best->addr;
+}
+
+// Map the page at pte to the frame page instead, copy-on-write.
+static void
+ksmmap(pte_t *pte, char *page)
+{
+  char *old = P2V(PTE_ADDR(*pte));
+
+  kdup(page);
+  *pte = V2P(page) | (PTE_FLAGS(*pte) & ~PTE_W) | PTE_COW;
+  kfree(old);
+  merged++;
+}
+
+// Make the page at pte a stable frame. Returns it, or 0 if the
+// table is full.
+static char*
+ksmstable(pte_t *pte, uint hash)
+{
+  struct ksmframe *f;
+
+  for(f = stable; f < &stable[NKSM]; f++){
+    if(f->page == 0){
+      f->page = P2V(PTE_ADDR(*pte));
+      f->hash = hash;
+      kdup(f->page);
+      *pte = (*pte & ~PTE_W) | PTE_COW;
+      nstable++;
+      return f->page;
+    }
+  }
+  return 0;
+}
+
+// The PTE of the page e remembers, or 0 if it can't be merged
+// anymore: its process exited, is running, or unmapped or locked
+// the page. ptable.lock must be held.
+static pte_t*
+ksmseenpte(struct ksmseen *e)
+{
+  struct proc *p = e->p;
+  pte_t *pte;
+
+  if(p->pid != e->pid || (p->state != SLEEPING && p->state != RUNNABLE))
+    return 0;
+  if(p->pgdir == 0 || !p->ksm || p->vm->cpus || ksmnext(p, e->va) != e->va)
+    return 0;
+  if((pte = walkpgdir2(p->pgdir, (void*)e->va, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_P | PTE_U | PTE_LOCK | PTE_WP)) != (PTE_P | PTE_U))
+    return 0;
+  return pte;
+}
+
+// Try to merge the page of p at va, mapped by pte.
+static void
+ksmpage(struct ksmround *r, struct proc *p, uint va, pte_t *pte)
+{
+  char *page = P2V(PTE_ADDR(*pte)), *s;
+  struct ksmframe *f;
+  struct ksmseen *e;
+  pte_t *epte;
+  uint h;
+  int i;
+
+  for(f = stable; f < &stable[NKSM]; f++)
+    if(f->page == page)
+      return;  // Already merged
+
+  h = ksmhash(page);
+  for(f = stable; f < &stable[NKSM]; f++){
+    if(f->page && f->hash == h && memcmp(f->page, page, PGSIZE) == 0){
+      ksmmap(pte, f->page);
+      return;
+    }
+  }
+
+  for(i = 0; i < r->nseen; i++){
+    e = &r->seen[i];
+    if(e->hash != h)
+      continue;
+    if((epte = ksmseenpte(e)) == 0){
+      *e = r->seen[--r->nseen];
+      i--;
+      continue;
+    }
+    if(PTE_ADDR(*epte) == PTE_ADDR(*pte))
+      continue;
+    if(memcmp(P2V(PTE_ADDR(*epte)), page, PGSIZE) != 0)
+      continue;
+    if((s = ksmstable(epte, h)) != 0)
+      ksmmap(pte, s);
+    *e = r->seen[--r->nseen];
+    return;
+  }
+
+  if(r->nseen < NKSMSEEN){
+    e = &r->seen[r->nseen++];
+    e->hash = h;
+    e->p = p;
+    e->pid = p->pid;
+    e->va = va;
+  }
+}
+
+// Called by procscan() with ptable.lock held and p not running.
+// Looks at the next KSMBATCH of p's KSMPAGES pages this round, then
+// stops the scan so that ksmd lets go of ptable.lock.
+static int
+ksmscan(struct proc *p, void *arg)
+{
+  struct ksmround *r = arg;
+  pte_t *pte;
+  uint va;
+  int n;
+
+  // Threads of p may be running with these PTEs in their TLBs,
+  // and no shootdown is possible with ptable.lock held.
+  if(!p->ksm || p->vm->cpus)
+    return 0;
+  if(p->pid != r->pid){
+    r->pid = p->pid;
+    r->n = 0;
+  }
+  va = p->ksmva;
+  for(n = 0; n < KSMBATCH && r->n < KSMPAGES; n++, r->n++, va += PGSIZE){
+    if((va = ksmnext(p, va)) == -1){
+      va = 0;  // Start over next round
+      r->n = KSMPAGES;
+      break;
+    }
+    if((pte = walkpgdir2(p->pgdir, (void*)va, 0)) == 0)
+      continue;
+    // Locked and protected pages keep their frames.
+    if((*pte & (PTE_P | PTE_U | PTE_LOCK | PTE_WP)) != (PTE_P | PTE_U))
+      continue;
+    ksmpage(r, p, va, pte);
+  }
+  p->ksmva = va;
+  return 1;
+}
+
+// Drop stable frames that nobody but ksmd maps anymore.
+static void
+ksmprune(void)
+{
+  struct ksmframe *f;
+
+  for(f = stable; f < &stable[NKSM]; f++){
+    if(f->page && pageframe_counters[V2P(f->page) / PGSIZE] == 1){
+      kfree(f->page);
+      f->page = 0;
+      nstable--;
+    }
+  }
+}
+
+static struct ksmround round;
+
+static void
+ksmd(void)
+{
+  uint t0;
+  int i;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    while(ticks - t0 < KSMPERIOD)
+      sleep(&ticks, &tickslock);
+    release(&tickslock);
+
+    ksmprune();
+    round.nseen = 0;
+    round.pid = 0;
+    for(i = 0; (i = procscan(ksmscan, &round, i)) < NPROC; ){
+      if(round.n >= KSMPAGES)
+        i++;  // Done with this process
+    }
+  }
+}
+
+void
+ksminit(void)
+{
+  if(kthread("ksmd", ksmd) < 0)
+    panic("ksminit");
+}
+
+void
+ksmstat(struct memstat *m)
+{
+  m->merged = merged;
+  m->ksmframes = nstable;
+}
+
+// Opt the calling process, and children it forks later, in to
+// (on != 0) or out of page merging. Pages merged already stay merged.
+int
+sys_ksm(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  myproc()->ksm = on != 0;
+  return 0;
+}
@@ -0,0 +1,73 @@
+// Scheduling latency under load. NSPIN CPU-bound processes and one
+// that sleeps for a tick NSLEEP times all run on CPU 0. The sleeper
+// should wake within a tick or two each time; the report shows how
+// many ticks its NSLEEP sleeps took, and how many context switches
+// CPU 0 made meanwhile. The run is repeated with the spinners in
+// SCHED_BATCH and the sleeper in SCHED_INTERACTIVE.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "sched.h"
+#include "schedstat.h"
+
+#define NSPIN   3
+#define NSLEEP  100
+
+static struct cpustat st[NCPU];
+
+static void
+spinner(void)
+{
+  volatile uint x = 0;
+
+  for(;;)
+    x++;
+}
+
+static uint
+switches(void)
+{
+  getcpustats(st, NCPU);
+  return st[0].switches;
+}
+
+static void
+run(char *label, int spinpolicy, int sleeppolicy)
+{
+  int pid[NSPIN], i, t0;
+  uint sw;
+
+  setsched(spinpolicy);
+  for(i = 0; i < NSPIN; i++){
+    if((pid[i] = fork()) < 0){
+      printf(1, "latbench: fork failed\n");
+      exit();
+    }
+    if(pid[i] == 0)
+      spinner();
+  }
+  setsched(sleeppolicy);
+  sleep(1);  // Let the spinners start
+  sw = switches();
+  t0 = uptime();
+  for(i = 0; i < NSLEEP; i++)
+    sleep(1);
+  printf(1, "%s: %d sleeps in %d ticks, %d switches\n",
+         label, NSLEEP, uptime() - t0, switches() - sw);
+  for(i = 0; i < NSPIN; i++){
+    kill(pid[i]);
+    wait();
+  }
+}
+
+int
+main(void)
+{
+  setaffinity(getpid(), 1);
+  run("prio", SCHED_PRIO, SCHED_PRIO);
+  run("batch/interactive", SCHED_BATCH, SCHED_INTERACTIVE);
+  setsched(SCHED_PRIO);
+  exit();
+}
@@ -0,0 +1,6 @@
+struct memstat {
+  int frees;      // Free page frames
+  int locked;     // Pages locked by mlock()
+  int merged;     // Pages merged by ksmd so far
+  int ksmframes;  // Frames that merged pages share now
+};
@@ -2,12 +2,48 @@
 #include "stat.h"
 #include "user.h"
 #include "fcntl.h"
+#include "memstat.h"
 
 #define PGSIZE 4096
 #define MAP_FAILED ((void *) -1)
 
 #define MAP_PROT_READ  0x00000001
 #define MAP_PROT_WRITE 0x00000002
+#define MAP_ANONYMOUS  0x00000004
+#define MAP_SHARED     0x00000008
+#define MAP_PRIVATE    0x00000010
+#define MAP_POPULATE   0x00000020
+
+#define MREMAP_MAYMOVE 0x00000001
+
+#define SHM_CREAT 1
+
+#define MS_ASYNC 0x00000001
+#define MS_SYNC  0x00000004
+
+// Mutex on a futex: 0 unlocked, 1 locked, 2 locked with waiters.
+// Only the contended paths enter the kernel.
+static void
+lock(volatile int *l)
+{
+  int c;
+
+  if ((c = __sync_val_compare_and_swap(l, 0, 1)) == 0)
+    return;
+  do {
+    if (c == 2 || __sync_val_compare_and_swap(l, 1, 2) != 0)
+      futex_wait((int *)l, 2);
+  } while ((c = __sync_val_compare_and_swap(l, 0, 2)) != 0);
+}
+
+static void
+unlock(volatile int *l)
+{
+  if (__sync_fetch_and_sub(l, 1) != 1) {
+    *l = 0;
+    futex_wake((int *)l, 1);
+  }
+}
 
 int
 main(void)
@@ -64,13 +100,194 @@ main(void)
     write(1, &(mapped[i]), 1);
   }
 
+  // Sync without unmapping
+  printf(1, "\n6. Try to msync\n");
+  if (msync((void*)mapped, length, MS_SYNC) == 0)
+    printf(1, "msync success\n");
+  else
+    printf(1, "msync failure\n");
+
+  // Write again after msync. The page must be tracked as dirty again.
+  mapped[5] = '!';
+  printf(1, "Write after msync success\n");
+
   // Unmap
-  printf(1, "\n6. Try to unmap\n");
+  printf(1, "\n7. Try to unmap\n");
   if (munmap((void*)mapped, length) == 0)
     printf(1, "unmap success\n");
   else
     printf(1, "unmap failure\n");
 
   close(fd);
+
+  // Anonymous mapping. Pages are zero-filled on first touch.
+  printf(1, "\n8. Try anonymous mmap of 4 pages\n");
+  char *anon = (char *)mmap(-1, 0, 4 * PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS);
+  if (anon == MAP_FAILED) {
+    printf(1, "anonymous mmap failed\n");
+    exit();
+  }
+  anon[3 * PGSIZE + 7] = 'x';
+  if (anon[PGSIZE] == 0 && anon[3 * PGSIZE + 7] == 'x')
+    printf(1, "anonymous mmap success\n");
+  else
+    printf(1, "anonymous mmap failure\n");
+  if (munmap((void*)anon, 4 * PGSIZE) == 0)
+    printf(1, "anonymous unmap success\n");
+  else
+    printf(1, "anonymous unmap failure\n");
+
+  // Map and unmap many times. Freed ranges must be reused.
+  printf(1, "\n9. Try 1000 anonymous mmap/munmap rounds\n");
+  for (int i = 0; i < 1000; i++) {
+    char *p = (char *)mmap(-1, 0, 16 * PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS);
+    if (p == MAP_FAILED || p != anon + 4 * PGSIZE - 16 * PGSIZE) {
+      printf(1, "round %d: mmap failed or address not reused (0x%x)\n", i, (int)p);
+      exit();
+    }
+    p[0] = 1;
+    munmap((void*)p, 16 * PGSIZE);
+  }
+  printf(1, "mmap/munmap rounds success\n");
+
+  // fork() children inherit mappings. Shared ones see each other's writes;
+  // private ones are copy-on-write.
+  printf(1, "\n10. Try fork with shared and private anonymous mappings\n");
+  char *shared = (char *)mmap(-1, 0, PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS | MAP_SHARED);
+  char *private = (char *)mmap(-1, 0, PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS | MAP_PRIVATE);
+  if (shared == MAP_FAILED || private == MAP_FAILED) {
+    printf(1, "mmap for fork failed\n");
+    exit();
+  }
+  private[0] = 'p';
+  if (fork() == 0) {
+    shared[0] = 'c';
+    private[0] = 'c';
+    exit();
+  }
+  wait();
+  if (shared[0] == 'c' && private[0] == 'p')
+    printf(1, "fork inheritance success\n");
+  else
+    printf(1, "fork inheritance failure\n");
+
+  // Grow a mapping. The data must move with it.
+  printf(1, "\n11. Try mremap from 1 to 3 pages\n");
+  char *grown = (char *)mremap((void*)private, PGSIZE, 3 * PGSIZE, MREMAP_MAYMOVE);
+  if (grown != MAP_FAILED && grown[0] == 'p' && grown[2 * PGSIZE] == 0)
+    printf(1, "mremap success\n");
+  else
+    printf(1, "mremap failure\n");
+
+  // A write to a read-only page kills the writer.
+  printf(1, "\n12. Try mprotect to read-only and back\n");
+  if (fork() == 0) {
+    mprotect(grown, PGSIZE, MAP_PROT_READ);
+    grown[0] = 'x';
+    shared[0] = 'w'; // Not reached
+    exit();
+  }
+  wait();
+  if (shared[0] != 'w' && mprotect(grown, PGSIZE, MAP_PROT_READ) == 0 &&
+      mprotect(grown, PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE) == 0) {
+    grown[0] = 'y';
+    printf(1, "mprotect success\n");
+  } else
+    printf(1, "mprotect failure\n");
+
+  // Prefault and lock a mapping. Locked pages show up in memstat().
+  printf(1, "\n13. Try MAP_POPULATE and mlock\n");
+  struct memstat before, locked, after;
+  memstat(&before);
+  char *pinned = (char *)mmap(-1, 0, 4 * PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS | MAP_POPULATE);
+  if (pinned != MAP_FAILED && mlock(pinned, 4 * PGSIZE) == 0) {
+    memstat(&locked);
+    munlock(pinned, 4 * PGSIZE);
+    memstat(&after);
+    if (locked.locked == before.locked + 4 && after.locked == before.locked)
+      printf(1, "mlock success\n");
+    else
+      printf(1, "mlock failure\n");
+    munmap(pinned, 4 * PGSIZE);
+  } else
+    printf(1, "mlock failure\n");
+
+  // Identical pages get merged after a few ksmd rounds. A write
+  // to one of them must not show up in the others.
+  printf(1, "\n14. Try merging identical pages\n");
+  char *same = (char *)mmap(-1, 0, 8 * PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS | MAP_PRIVATE);
+  memstat(&before);
+  ksm(1);
+  for (int i = 0; i < 8 * PGSIZE; i++)
+    same[i] = 'k';
+  sleep(400);
+  memstat(&after);
+  ksm(0);
+  same[0] = 'x';
+  if (after.merged > before.merged && same[PGSIZE] == 'k' && same[0] == 'x')
+    printf(1, "merge success (%d pages)\n", after.merged - before.merged);
+  else
+    printf(1, "merge failure\n");
+  munmap(same, 8 * PGSIZE);
+
+  // A child writes into a segment; the parent maps it afterwards
+  // and reads what the child wrote.
+  printf(1, "\n15. Try a named shared memory segment\n");
+  int id = shmopen(15, 2 * PGSIZE, SHM_CREAT);
+  if (fork() == 0) {
+    char *seg = (char *)shmmap(id, 0, MAP_PROT_READ | MAP_PROT_WRITE);
+    if (seg != MAP_FAILED)
+      strcpy(seg + PGSIZE, "hello");
+    exit();
+  }
+  wait();
+  char *seg = (char *)shmmap(id, 0, MAP_PROT_READ);
+  shmunlink(15);
+  if (id >= 0 && seg != MAP_FAILED && strcmp(seg + PGSIZE, "hello") == 0)
+    printf(1, "shm success\n");
+  else
+    printf(1, "shm failure\n");
+  if (seg != MAP_FAILED)
+    munmap(seg, 2 * PGSIZE);
+
+  // Two processes increment a shared counter under a futex mutex.
+  printf(1, "\n16. Try a futex mutex in a shared mapping\n");
+  volatile int *word = (int *)mmap(-1, 0, PGSIZE, MAP_PROT_READ | MAP_PROT_WRITE | MAP_ANONYMOUS | MAP_SHARED);
+  int pid = fork();
+  for (int i = 0; i < 1000; i++) {
+    lock(&word[0]);
+    int v = word[1];
+    if (i % 100 == 0)
+      yield();
+    word[1] = v + 1;
+    unlock(&word[0]);
+  }
+  if (pid == 0)
+    exit();
+  wait();
+  if (word[1] == 2000)
+    printf(1, "futex success\n");
+  else
+    printf(1, "futex failure (%d)\n", word[1]);
+  munmap((void *)word, PGSIZE);
+
+  // Unmapping one of two mappings of a file must leave the other.
+  // If it doesn't, the child faults and is killed.
+  printf(1, "\n17. Try unmapping one of two mappings of a file\n");
+  shared[0] = 0;
+  if (fork() == 0) {
+    fd = open(filename, O_RDONLY);
+    char *m1 = (char *)mmap(fd, 0, PGSIZE, MAP_PROT_READ);
+    char *m2 = (char *)mmap(fd, 0, PGSIZE, MAP_PROT_READ);
+    if (m1 != MAP_FAILED && m2 != MAP_FAILED && munmap(m1, PGSIZE) == 0)
+      shared[0] = m2[0];
+    exit();
+  }
+  wait();
+  if (shared[0] != 0)
+    printf(1, "partial unmap success\n");
+  else
+    printf(1, "partial unmap failure\n");
+
   exit();
 }
\ No newline at end of file
@@ -94,8 +94,12 @@ struct segdesc {
 #define PTE_P           0x001   // Present
 #define PTE_W           0x002   // Writeable
 #define PTE_U           0x004   // User
+#define PTE_A           0x020   // Accessed
+#define PTE_D           0x040   // Dirty
 #define PTE_PS          0x080   // Page Size
 #define PTE_COW         0x200   // Copy on Write
+#define PTE_WP          0x400   // Write-protected by mprotect(). Without PTE_U, no access
+#define PTE_LOCK        0x800   // Locked in memory by mlock()
 
 // Address in page table or page directory entry
 #define PTE_ADDR(pte)   ((uint)(pte) & ~0xFFF)
@@ -4,12 +4,114 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "x86.h"
+#include "traps.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
+#include "sched.h"
+#include "schedstat.h"
+
+#define MAP_PROT_WRITE 0x00000002
+
+// Run queues, one per nice value. The lowest nice value runs first.
+// A process that uses up its timeslice goes to the expired queues
+// with a new one, and runs again once the active queues are empty,
+// so no runnable process starves. Sleepers keep the rest of their
+// slice and so come back ahead of CPU-bound processes.
+//
+// Each CPU has its own set of queues. A process is queued on the
+// CPU it last ran on, unless that CPU has clearly more work than
+// the one making it runnable. A CPU whose queues are empty steals
+// from the busiest CPU. The split is for cache locality only: the
+// queues are still protected by the one ptable.lock, which also
+// hands a process over across swtch() and orders sleep() with
+// wakeup(), so every sleep, wakeup, yield and steal serializes on
+// it and scheduling does not scale with the number of CPUs. A CPU with nothing to run halts until an
+// interrupt; queuing a process kicks its CPU, or an idle one that
+// may steal it, with an IPI (see kick()).
+//
+// Processes with policy SCHED_FAIR are scheduled instead by virtual
+// runtime: each tick adds to it in inverse proportion to a weight
+// from nice, and the smallest vruntime runs next, from a min-heap
+// per CPU. Their CPU shares thus follow the weights. A woken sleeper
+// may be at most FAIRCREDIT behind the queue's minimum, so it runs
+// soon without monopolizing the CPU. SCHED_PRIO processes run first.
+//
+// SCHED_BATCH and SCHED_INTERACTIVE processes share the SCHED_PRIO
+// queues but get BATCHSCALE times longer and half as long slices.
+// A batch process also gives way at the next tick once an
+// interactive one is queued on its CPU. A process that is alone on
+// its CPU keeps running when its slice ends or it yields.
+#define NICE_MIN   -5
+#define NICE_MAX   4
+#define NQUEUE     (NICE_MAX - NICE_MIN + 1)
+#define BATCHSCALE 4
+
+#ifndef QUANTUM
+#define QUANTUM    5   // Slice at nice 0, in ticks; see setquantum()
+#endif
+#define MAXQUANTUM 100
+
+#define NICE0_WEIGHT 1024
+#define FAIRTICK(n)  (NICE0_WEIGHT * 1024 / weights[(n) - NICE_MIN])  // vruntime per tick
+#define FAIRGRAN     1024       // Preempt once this far ahead of the minimum
+#define FAIRCREDIT   (3 * 1024) // Most a sleeper can be behind
+
+#ifndef SCHED_DEFAULT
+#define SCHED_DEFAULT SCHED_PRIO  // Policy of init, and so of everything by default
+#endif
+
+// Each nice step changes the share by about 25%.
+static int weights[NQUEUE] = {
+  3121, 2501, 1991, 1586, 1277, 1024, 820, 655, 526, 423
+};
+
+static int quantum = QUANTUM;
+
+// Timeslice of p in ticks: 2 * quantum at nice -5 down to
+// quantum / 5 at nice 4, scaled by its class.
+static int
+slice(struct proc *p)
+{
+  int s = quantum * (NICE_MAX + 1 - p->nice) / (NICE_MAX + 1);
+
+  if(p->policy == SCHED_BATCH)
+    s *= BATCHSCALE;
+  else if(p->policy == SCHED_INTERACTIVE)
+    s /= 2;
+  return s > 0 ? s : 1;
+}
+
+struct runqueue {
+  struct proc *head[NQUEUE];
+  struct proc *tail[NQUEUE];
+  uint bitmap;                 // Bit i set if head[i] isn't empty
+};
+
+struct cpurq {
+  struct runqueue rq[2];
+  struct runqueue *active;
+  struct runqueue *expired;
+  struct proc *fair[NPROC];    // Min-heap of SCHED_FAIR processes by vruntime
+  int nfair;
+  uint minvrt;                 // Smallest vruntime run so far; never decreases
+  volatile int nrun;           // Processes queued
+  volatile int ninter;         // SCHED_INTERACTIVE processes queued
+};
+
+// Sleeping processes are kept in a hash table by channel, so that
+// wakeup() looks only at those that might sleep on its channel.
+#define SLEEPQBITS 6
+#define NSLEEPQ    (1 << SLEEPQBITS)
+#define SLEEPQ(chan) (&ptable.sleepq[((uint)(chan) * 2654435761u) >> (32 - SLEEPQBITS)])
 
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct cpurq rq[NCPU];
+  struct proc *sleepq[NSLEEPQ];
+  struct proc *free;           // UNUSED procs
 } ptable;
 
 static struct proc *initproc;
@@ -17,13 +119,287 @@ static struct proc *initproc;
 int nextpid = 1;
 extern void forkret(void);
 extern void trapret(void);
+static void kthreadret(void);
 
 static void wakeup1(void *chan);
 
+// Link p at the head of list, one of ptable.free or another
+// proc's children or zombies. ptable.lock must be held.
+static void
+plink(struct proc **list, struct proc *p)
+{
+  p->siblingprev = list;
+  if((p->sibling = *list) != 0)
+    p->sibling->siblingprev = &p->sibling;
+  *list = p;
+}
+
+// Take p off the list it is on. ptable.lock must be held.
+static void
+punlink(struct proc *p)
+{
+  if((*p->siblingprev = p->sibling) != 0)
+    p->sibling->siblingprev = p->siblingprev;
+}
+
+// Return p to the free list. ptable.lock must be held.
+static void
+freeproc(struct proc *p)
+{
+  p->state = UNUSED;
+  plink(&ptable.free, p);
+}
+
 void
 pinit(void)
 {
+  struct cpurq *crq;
+  struct proc *p;
+
   initlock(&ptable.lock, "ptable");
+  for(p = &ptable.proc[NPROC-1]; p >= ptable.proc; p--)
+    plink(&ptable.free, p);
+  for(crq = ptable.rq; crq < &ptable.rq[NCPU]; crq++){
+    crq->active = &crq->rq[0];
+    crq->expired = &crq->rq[1];
+  }
+}
+
+// Is a's vruntime before b's? Works across wraparound.
+static int
+vrtless(struct proc *a, struct proc *b)
+{
+  return (int)(a->vruntime - b->vruntime) < 0;
+}
+
+static void
+fairpush(struct cpurq *crq, struct proc *p)
+{
+  int i, up;
+
+  for(i = crq->nfair++; i > 0; i = up){
+    up = (i - 1) / 2;
+    if(!vrtless(p, crq->fair[up]))
+      break;
+    crq->fair[i] = crq->fair[up];
+  }
+  crq->fair[i] = p;
+}
+
+static struct proc*
+fairpop(struct cpurq *crq)
+{
+  struct proc *p = crq->fair[0], *last;
+  int i, c;
+
+  last = crq->fair[--crq->nfair];
+  for(i = 0; (c = 2 * i + 1) < crq->nfair; i = c){
+    if(c + 1 < crq->nfair && vrtless(crq->fair[c + 1], crq->fair[c]))
+      c++;
+    if(!vrtless(crq->fair[c], last))
+      break;
+    crq->fair[i] = crq->fair[c];
+  }
+  crq->fair[i] = last;
+  return p;
+}
+
+// Tell cpus[i] that there is work for it, waking it if halted.
+// The calling CPU is awake already, but may be in an interrupt
+// between scheduler() looking at its queues and idle().
+// ptable.lock must be held.
+static void
+kick(int i)
+{
+  struct cpu *c = &cpus[i];
+
+  c->kicked = 1;
+  __sync_synchronize();  // Pairs with the one in idle()
+  if(c->idle && i != cpuid())
+    lapicipi(c->apicid, T_WAKEUP);
+}
+
+// p was queued on its CPU by CPU me. Make sure some CPU will run
+// it soon: its own if idle, else an idle one that may steal it.
+static void
+wakecpu(struct proc *p, int me)
+{
+  int i;
+
+  kick(p->cpu);
+  if(cpus[p->cpu].idle || p == myproc())  // yield(): this CPU runs it next
+    return;
+  for(i = 0; i < ncpu; i++){
+    if(i != me && i != p->cpu && cpus[i].idle && (p->affinity & (1 << i))){
+      kick(i);
+      return;
+    }
+  }
+}
+
+// Move p to cpu, counting migrations. Each CPU's minvrt grows on
+// its own, so a SCHED_FAIR process keeps its vruntime relative to
+// the queue's minimum, neither starving on nor hogging the new CPU.
+static void
+setcpu(struct proc *p, int cpu)
+{
+  if(p->cpu != cpu){
+    if(p->policy == SCHED_FAIR)
+      p->vruntime += ptable.rq[cpu].minvrt - ptable.rq[p->cpu].minvrt;
+    p->cpu = cpu;
+    p->migrations++;
+  }
+}
+
+// The CPU p may run on with the fewest processes queued.
+static int
+leastloaded(struct proc *p)
+{
+  int i, best = p->cpu;
+
+  for(i = 0; i < ncpu; i++){
+    if(!(p->affinity & (1 << i)))
+      continue;
+    if(!(p->affinity & (1 << best)) || ptable.rq[i].nrun < ptable.rq[best].nrun)
+      best = i;
+  }
+  return best;
+}
+
+// Make p RUNNABLE and queue it, taking it off its sleep queue
+// if it was SLEEPING. ptable.lock must be held.
+static void
+runnable(struct proc *p)
+{
+  struct cpurq *crq;
+  struct runqueue *rq;
+  int q = p->nice - NICE_MIN;
+  int me = cpuid();
+
+  if(p->state == SLEEPING){
+    if((*p->sleepprev = p->sleepnext) != 0)
+      p->sleepnext->sleepprev = p->sleepprev;
+  }
+
+  // Stay cache-warm on the last CPU unless it is overloaded
+  // or no longer allowed.
+  if(!(p->affinity & (1 << p->cpu)))
+    setcpu(p, leastloaded(p));
+  else if((p->affinity & (1 << me)) && ptable.rq[p->cpu].nrun > ptable.rq[me].nrun + 1)
+    setcpu(p, me);
+  crq = &ptable.rq[p->cpu];
+  crq->nrun++;
+  p->readytick = ticks;
+  wakecpu(p, me);
+  p->state = RUNNABLE;
+  if(p->policy == SCHED_FAIR){
+    if((int)(p->vruntime - (crq->minvrt - FAIRCREDIT)) < 0)
+      p->vruntime = crq->minvrt - FAIRCREDIT;
+    fairpush(crq, p);
+    return;
+  }
+  if(p->policy == SCHED_INTERACTIVE)
+    crq->ninter++;
+  rq = crq->active;
+  if(p->slice <= 0){
+    p->slice = slice(p);
+    rq = crq->expired;
+  }
+  p->rqnext = 0;
+  if(rq->head[q])
+    rq->tail[q]->rqnext = p;
+  else
+    rq->head[q] = p;
+  rq->tail[q] = p;
+  rq->bitmap |= 1 << q;
+}
+
+// Dequeue the next process from crq, or return 0.
+static struct proc*
+dequeue(struct cpurq *crq)
+{
+  struct runqueue *rq = crq->active;
+  struct proc *p;
+  int q;
+
+  if(rq->bitmap == 0){
+    crq->active = crq->expired;
+    crq->expired = rq;
+    rq = crq->active;
+  }
+  if(rq->bitmap){
+    q = __builtin_ctz(rq->bitmap);
+    p = rq->head[q];
+    if((rq->head[q] = p->rqnext) == 0)
+      rq->bitmap &= ~(1 << q);
+    if(p->policy == SCHED_INTERACTIVE)
+      crq->ninter--;
+  } else if(crq->nfair){
+    p = fairpop(crq);
+    if((int)(p->vruntime - crq->minvrt) > 0)
+      crq->minvrt = p->vruntime;
+  } else
+    return 0;
+  crq->nrun--;
+  return p;
+}
+
+// The process dequeue(crq) would return, or 0.
+static struct proc*
+peekproc(struct cpurq *crq)
+{
+  struct runqueue *rq = crq->active;
+
+  if(rq->bitmap == 0)
+    rq = crq->expired;
+  if(rq->bitmap)
+    return rq->head[__builtin_ctz(rq->bitmap)];
+  return crq->nfair ? crq->fair[0] : 0;
+}
+
+// Dequeue the RUNNABLE process that CPU c runs next, stealing
+// from the busiest CPU if c has none, or return 0.
+// ptable.lock must be held.
+static struct proc*
+pickproc(struct cpu *c)
+{
+  struct cpurq *crq, *busiest = 0;
+  struct proc *p;
+  int me = c - cpus;
+
+  // A process whose affinity changed while queued moves on.
+  while((p = dequeue(&ptable.rq[me])) != 0){
+    if(p->affinity & (1 << me))
+      return p;
+    runnable(p);
+  }
+  for(crq = ptable.rq; crq < &ptable.rq[ncpu]; crq++){
+    if(crq->nrun == 0 || (busiest && crq->nrun <= busiest->nrun))
+      continue;
+    if((p = peekproc(crq)) != 0 && (p->affinity & (1 << me)))
+      busiest = crq;
+  }
+  if(busiest == 0)
+    return 0;
+  p = dequeue(busiest);
+  setcpu(p, me);
+  return p;
+}
+
+// Halt until an interrupt, unless work was queued for c since
+// scheduler() last looked. Interrupts must be on.
+static void
+idle(struct cpu *c)
+{
+  cli();
+  c->idle = 1;
+  __sync_synchronize();
+  if(!c->kicked){
+    c->halts++;
+    asm volatile("sti; hlt");  // sti takes effect after hlt starts
+  }
+  c->idle = 0;
+  sti();
 }
 
 // Must be called with interrupts disabled
@@ -66,7 +442,7 @@ myproc(void) {
 }
 
 //PAGEBREAK: 32
-// Look in the process table for an UNUSED proc.
+// Take an UNUSED proc from the free list.
 // If found, change state to EMBRYO and initialize
 // state required to run in the kernel.
 // Otherwise return 0.
@@ -78,29 +454,33 @@ allocproc(void)
 
   acquire(&ptable.lock);
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == UNUSED)
-      goto found;
-
-  release(&ptable.lock);
-  return 0;
+  if((p = ptable.free) == 0){
+    release(&ptable.lock);
+    return 0;
+  }
+  punlink(p);
 
-found:
   p->state = EMBRYO;
   p->pid = nextpid++;
-  p->mmap_sp = KERNBASE - PGSIZE;
-
-  // Set all mmaps to unused
-  for (int i = 0; i < MAX_MMAPS_PROC; i++)
-  {
-    p->mmaps[i].used = 0;
-  }
+  p->cpu = cpuid();  // Start out near the creator
+  p->migrations = 0;
+  p->vm = 0;
+  p->ksm = 0;
+  p->ksmva = 0;
+  p->children = 0;
+  p->zombies = 0;
+  p->cputicks = p->waitticks = 0;
+  p->vcsw = p->ivcsw = 0;
+  p->cowfaults = p->mmapfaults = p->zerofaults = 0;
+  p->syscalls = 0;
   
   release(&ptable.lock);
 
   // Allocate kernel stack.
   if((p->kstack = kalloc()) == 0){
-    p->state = UNUSED;
+    acquire(&ptable.lock);
+    freeproc(p);
+    release(&ptable.lock);
     return 0;
   }
   sp = p->kstack + KSTACKSIZE;
@@ -122,6 +502,56 @@ found:
   return p;
 }
 
+// Undo allocproc() for a proc that never ran.
+static void
+unallocproc(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  acquire(&ptable.lock);
+  freeproc(p);
+  release(&ptable.lock);
+}
+
+// Allocate an empty address space with no mappings, used by one proc.
+static struct vmspace*
+vmalloc(void)
+{
+  struct vmspace *vm;
+
+  if((vm = (struct vmspace*)kalloc()) == 0)
+    return 0;
+  memset(vm, 0, PGSIZE);  // Set all mmaps to unused
+  initsleeplock(&vm->lock, "vmspace");
+  initlock(&vm->ptlock, "ptlock");
+  vm->ref = 1;
+  vm->users = 1;
+  vm->mmap_sp = KERNBASE - PGSIZE;
+  vm->holes[0].start = 0;
+  vm->holes[0].end = KERNBASE - PGSIZE;
+  vm->nholes = 1;
+  return vm;
+}
+
+// Drop p's reference to its address space. The last one frees
+// the page table too. Called by wait() for a zombie.
+static void
+vmput(struct proc *p)
+{
+  struct vmspace *vm = p->vm;
+  int last;
+
+  acquire(&vm->ptlock);
+  last = --vm->ref == 0;
+  release(&vm->ptlock);
+  if(last){
+    freevm(p->pgdir);
+    kfree((char*)vm);
+  }
+  p->pgdir = 0;
+  p->vm = 0;
+}
+
 //PAGEBREAK: 32
 // Set up first user process.
 void
@@ -133,7 +563,7 @@ userinit(void)
   p = allocproc();
   
   initproc = p;
-  if((p->pgdir = setupkvm()) == 0)
+  if((p->pgdir = setupkvm()) == 0 || (p->vm = vmalloc()) == 0)
     panic("userinit: out of memory?");
   cprintf("%p %p\n", _binary_initcode_start, _binary_initcode_size);
   inituvm(p->pgdir, _binary_initcode_start, (int)_binary_initcode_size);
@@ -147,6 +577,8 @@ userinit(void)
   p->tf->esp = PGSIZE;
   p->tf->eip = 0;  // beginning of initcode.S
   p->nice = 2;
+  p->policy = SCHED_DEFAULT;
+  p->affinity = ~0;
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
@@ -157,11 +589,54 @@ userinit(void)
   // because the assignment might not be atomic.
   acquire(&ptable.lock);
 
-  p->state = RUNNABLE;
+  p->slice = slice(p);
+  runnable(p);
 
   release(&ptable.lock);
 }
 
+// Start a kernel thread that runs fn(). It has no user memory,
+// never returns to user space and never exits, so fn must not
+// return. Returns the new thread's pid, or -1.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  if((p->pgdir = setupkvm()) == 0){
+    unallocproc(p);
+    return -1;
+  }
+  if((p->vm = vmalloc()) == 0){
+    freevm(p->pgdir);
+    p->pgdir = 0;
+    unallocproc(p);
+    return -1;
+  }
+  p->sz = 0;
+  p->nice = 0;
+  p->policy = SCHED_PRIO;
+  p->affinity = ~0;
+
+  // allocproc() left trapret as forkret's return address.
+  // Start at kthreadret instead and "return" into fn.
+  p->context->eip = (uint)kthreadret;
+  *(uint*)(p->context + 1) = (uint)fn;
+
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  acquire(&ptable.lock);
+
+  p->slice = slice(p);
+  runnable(p);
+
+  release(&ptable.lock);
+
+  return p->pid;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
 int
@@ -169,18 +644,36 @@ growproc(int n)
 {
   uint sz;
   struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
+  struct proc *p;
 
+  acquiresleep(&vm->lock);
   sz = curproc->sz;
   if(n > 0){
+    if(sz + n > vm->mmap_sp)  // Would run into the lowest mapping
+      goto bad;
     if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+      goto bad;
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
-      return -1;
+    if(sz + n > sz)  // Below zero
+      goto bad;
+    tlbunmap(curproc, sz + n, sz);
+    sz += n;
   }
-  curproc->sz = sz;
+
+  // Threads sharing the address space keep equal copies of sz.
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->vm == vm)
+      p->sz = sz;
+  release(&ptable.lock);
+  releasesleep(&vm->lock);
   switchuvm(curproc);
   return 0;
+
+bad:
+  releasesleep(&vm->lock);
+  return -1;
 }
 
 // Create a new process copying p as the parent.
@@ -198,16 +691,44 @@ fork(void)
     return -1;
   }
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
-    kfree(np->kstack);
-    np->kstack = 0;
-    np->state = UNUSED;
+  if((np->vm = vmalloc()) == 0){
+    unallocproc(np);
+    return -1;
+  }
+
+  // Copy process state from proc. Other threads of curproc may
+  // fault meanwhile, but can't change the mappings.
+  acquiresleep(&curproc->vm->lock);
+  acquire(&curproc->vm->ptlock);
+  np->pgdir = copyuvm(curproc->pgdir, curproc->sz);
+  release(&curproc->vm->ptlock);
+  if(np->pgdir == 0){
+    releasesleep(&curproc->vm->lock);
+    tlbflush(curproc);
+    kfree((char*)np->vm);
+    np->vm = 0;
+    unallocproc(np);
+    return -1;
+  }
+  // Inherit mappings, sharing their frames. This also flushes
+  // the parent's TLBs, whose entries copyuvm() made read-only.
+  if(mmapfork(np, curproc) < 0){
+    releasesleep(&curproc->vm->lock);
+    freevm(np->pgdir);
+    np->pgdir = 0;
+    kfree((char*)np->vm);
+    np->vm = 0;
+    unallocproc(np);
     return -1;
   }
+  releasesleep(&curproc->vm->lock);
   np->sz = curproc->sz;
   np->parent = curproc;
   np->nice = curproc->nice;
+  np->policy = curproc->policy;
+  np->affinity = curproc->affinity;
+  np->vruntime = curproc->vruntime;
+  np->ksm = curproc->ksm;
   *np->tf = *curproc->tf;
 
   // Clear %eax so that fork returns 0 in the child.
@@ -224,13 +745,128 @@ fork(void)
 
   acquire(&ptable.lock);
 
-  np->state = RUNNABLE;
+  plink(&curproc->children, np);
+  np->slice = slice(np);
+  runnable(np);
 
   release(&ptable.lock);
 
   return pid;
 }
 
+// Can the kernel store to user address va of p? A fault that
+// trap() refuses would only mark p killed and return to the same
+// instruction, forever. Heap pages must be present, user-accessible
+// and not mprotect()ed; mapped ones must be in a writable mapping
+// and not mprotect()ed, and are faulted in as usual.
+// p->vm->lock must be held, so that mprotect() can't interfere.
+static int
+uwritable(struct proc *p, uint va)
+{
+  struct vmspace *vm = p->vm;
+  struct mmap_area *ma;
+  pte_t *pte;
+  int ok = -1;
+
+  for(ma = vm->mmaps; ma < &vm->mmaps[MAX_MMAPS_PROC]; ma++)
+    if(ma->used && va >= ma->addr && va < ma->addr + ma->length)
+      ok = (ma->flags & MAP_PROT_WRITE) != 0;
+  if(ok == 0 || (ok == -1 && va >= p->sz))
+    return 0;
+  acquire(&vm->ptlock);
+  pte = walkpgdir2(p->pgdir, (void*)va, 0);
+  if(pte && (*pte & PTE_WP))
+    ok = 0;
+  else if(pte && (*pte & PTE_P))
+    ok = (*pte & PTE_U) != 0;
+  else
+    ok = ok == 1;  // Only a mapping's pages are mapped on demand
+  release(&vm->ptlock);
+  return ok;
+}
+
+// Create a thread that shares the address space of the current
+// process and runs fn(arg) on the stack whose top is stack. The
+// thread gets copies of the open files, like fork(), and is waited
+// for with wait(). fn must call exit() rather than return.
+// Returns the thread's pid, or -1.
+int
+clone(void (*fn)(void*), void *stack, void *arg)
+{
+  int i, pid, ok;
+  struct proc *np;
+  struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
+  uint sp = (uint)stack - 8;
+
+  // The stack must hold a fake return address and arg.
+  if(sp >= (uint)stack || sp % 4 != 0)
+    return -1;
+  acquiresleep(&vm->lock);
+  ok = uwritable(curproc, sp) && uwritable(curproc, sp + 4);
+  if(ok){
+    *(uint*)(sp + 4) = (uint)arg;
+    *(uint*)sp = 0xffffffff;
+  }
+  releasesleep(&vm->lock);
+  if(!ok)
+    return -1;
+
+  if((np = allocproc()) == 0)
+    return -1;
+
+  // Share the page table. Holding vm->lock keeps growproc() from
+  // changing sz before np has it.
+  acquiresleep(&vm->lock);
+  acquire(&vm->ptlock);
+  vm->ref++;
+  vm->users++;
+  release(&vm->ptlock);
+  np->vm = vm;
+  np->pgdir = curproc->pgdir;
+  np->sz = curproc->sz;
+  releasesleep(&vm->lock);
+
+  np->parent = curproc;
+  np->nice = curproc->nice;
+  np->policy = curproc->policy;
+  np->affinity = curproc->affinity;
+  np->vruntime = curproc->vruntime;
+  np->ksm = curproc->ksm;
+  *np->tf = *curproc->tf;
+  np->tf->eip = (uint)fn;
+  np->tf->esp = sp;
+
+  for(i = 0; i < NOFILE; i++)
+    if(curproc->ofile[i])
+      np->ofile[i] = filedup(curproc->ofile[i]);
+  np->cwd = idup(curproc->cwd);
+
+  safestrcpy(np->name, curproc->name, sizeof(curproc->name));
+
+  pid = np->pid;
+
+  acquire(&ptable.lock);
+
+  plink(&curproc->children, np);
+  np->slice = slice(np);
+  runnable(np);
+
+  release(&ptable.lock);
+
+  return pid;
+}
+
+int
+sys_clone(void)
+{
+  int fn, stack, arg;
+
+  if(argint(0, &fn) < 0 || argint(1, &stack) < 0 || argint(2, &arg) < 0)
+    return -1;
+  return clone((void(*)(void*))fn, (void*)stack, (void*)arg);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -238,20 +874,40 @@ void
 exit(void)
 {
   struct proc *curproc = myproc();
+  struct vmspace *vm = curproc->vm;
   struct proc *p;
-  int fd;
+  int fd, i, last;
 
   if(curproc == initproc)
     panic("init exiting");
 
+  tlbdrain(curproc);
+
+  // Only the last thread out tears down the mappings.
+  acquire(&vm->ptlock);
+  last = --vm->users == 0;
+  release(&vm->ptlock);
+
   // Close all open files.
   for(fd = 0; fd < NOFILE; fd++){
     if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
+      if(last)
+        fileclose(curproc->ofile[fd]);
+      else
+        fileput(curproc->ofile[fd]);
       curproc->ofile[fd] = 0;
     }
   }
 
+  // Unmap what closing the files didn't (e.g. anonymous mappings).
+  if(last){
+    acquiresleep(&vm->lock);
+    for(i = 0; i < MAX_MMAPS_PROC; i++)
+      if(vm->mmaps[i].used)
+        munmap((void*)vm->mmaps[i].addr, vm->mmaps[i].length);
+    releasesleep(&vm->lock);
+  }
+
   begin_op();
   iput(curproc->cwd);
   end_op();
@@ -260,15 +916,23 @@ exit(void)
   acquire(&ptable.lock);
 
   // Parent might be sleeping in wait().
+  punlink(curproc);
+  plink(&curproc->parent->zombies, curproc);
   wakeup1(curproc->parent);
 
   // Pass abandoned children to init.
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->parent == curproc){
+  while((p = curproc->children) != 0){
+    punlink(p);
+    p->parent = initproc;
+    plink(&initproc->children, p);
+  }
+  if(curproc->zombies){
+    while((p = curproc->zombies) != 0){
+      punlink(p);
       p->parent = initproc;
-      if(p->state == ZOMBIE)
-        wakeup1(initproc);
+      plink(&initproc->zombies, p);
     }
+    wakeup1(initproc);
   }
 
   // Jump into the scheduler, never to return.
@@ -283,35 +947,29 @@ int
 wait(void)
 {
   struct proc *p;
-  int havekids, pid;
+  int pid;
   struct proc *curproc = myproc();
   
   acquire(&ptable.lock);
   for(;;){
-    // Scan through table looking for exited children.
-    havekids = 0;
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
-        continue;
-      havekids = 1;
-      if(p->state == ZOMBIE){
-        // Found one.
-        pid = p->pid;
-        kfree(p->kstack);
-        p->kstack = 0;
-        freevm(p->pgdir);
-        p->pid = 0;
-        p->parent = 0;
-        p->name[0] = 0;
-        p->killed = 0;
-        p->state = UNUSED;
-        release(&ptable.lock);
-        return pid;
-      }
+    // Take the first exited child.
+    if((p = curproc->zombies) != 0){
+      punlink(p);
+      pid = p->pid;
+      kfree(p->kstack);
+      p->kstack = 0;
+      vmput(p);
+      p->pid = 0;
+      p->parent = 0;
+      p->name[0] = 0;
+      p->killed = 0;
+      freeproc(p);
+      release(&ptable.lock);
+      return pid;
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || curproc->killed){
+    if(curproc->children == 0 || curproc->killed){
       release(&ptable.lock);
       return -1;
     }
@@ -340,21 +998,24 @@ scheduler(void)
     // Enable interrupts on this processor.
     sti();
 
-    // Loop over process table looking for process to run.
+    // Run processes from the run queues until they are empty.
+    // Work queued from now on kicks this CPU again.
+    c->kicked = 0;
     acquire(&ptable.lock);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->state != RUNNABLE)
-        continue;
-
+    while((p = pickproc(c)) != 0){
       // Switch to chosen process.  It is the process's job
       // to release ptable.lock and then reacquire it
       // before jumping back to us.
       c->proc = p;
       switchuvm(p);
       p->state = RUNNING;
+      p->waitticks += ticks - p->readytick;
 
+      c->switches++;
       swtch(&(c->scheduler), p->context);
       switchkvm();
+      // This CPU no longer caches p's page table (see tlbshoot()).
+      __sync_fetch_and_and(&p->vm->cpus, ~(1 << cpuid()));
 
       // Process is done running for now.
       // It should have changed its p->state before coming back.
@@ -362,6 +1023,8 @@ scheduler(void)
     }
     release(&ptable.lock);
 
+    // Nothing to run. Don't contend for ptable.lock.
+    idle(c);
   }
 }
 
@@ -391,16 +1054,135 @@ sched(void)
   mycpu()->intena = intena;
 }
 
+// True if nothing else is queued on p's CPU and p may stay there,
+// so that switching away would only come straight back to p.
+static int
+alone(struct proc *p)
+{
+  return ptable.rq[p->cpu].nrun == 0 && (p->affinity & (1 << p->cpu));
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
 {
   acquire(&ptable.lock);  //DOC: yieldlock
-  myproc()->state = RUNNABLE;
+  if(alone(myproc())){
+    release(&ptable.lock);
+    return;
+  }
+  myproc()->vcsw++;
+  runnable(myproc());
   sched();
   release(&ptable.lock);
 }
 
+// Like yield(), but the timeslice ran out (see trap()).
+void
+preempt(void)
+{
+  acquire(&ptable.lock);
+  myproc()->ivcsw++;
+  runnable(myproc());
+  sched();
+  release(&ptable.lock);
+}
+
+// Called by the running process on every clock tick. Returns
+// non-zero if it should yield: its timeslice is used up, or a
+// process with a lower nice value is waiting, or it is a batch
+// process and an interactive one is waiting. A SCHED_FAIR process
+// yields once it is FAIRGRAN ahead of the next one. A process that
+// is alone on its CPU just starts a new slice. Reads the queues
+// without ptable.lock, which at worst delays a switch by a tick.
+int
+schedtick(void)
+{
+  struct proc *p = myproc();
+  struct cpurq *crq = &ptable.rq[p->cpu];
+  uint higher = (1 << (p->nice - NICE_MIN)) - 1;
+  struct proc *next;
+
+  if(p->policy == SCHED_FAIR)
+    p->vruntime += FAIRTICK(p->nice);
+  else
+    p->slice--;
+  if(alone(p)){
+    if(p->slice <= 0)
+      p->slice = slice(p);
+    return 0;
+  }
+  if(p->policy == SCHED_FAIR){
+    if(crq->active->bitmap || crq->expired->bitmap)
+      return 1;
+    next = crq->nfair ? crq->fair[0] : 0;
+    return next && (int)(p->vruntime - next->vruntime) > FAIRGRAN;
+  }
+  if(p->slice <= 0)
+    return 1;
+  if(p->policy == SCHED_BATCH && crq->ninter)
+    return 1;
+  return (crq->active->bitmap & higher) != 0;
+}
+
+// Set the scheduling policy of the calling process, and of children
+// it creates later. Returns the previous policy, or -1.
+int
+setsched(int policy)
+{
+  struct proc *p = myproc();
+  int old;
+
+  if(policy < SCHED_PRIO || policy > SCHED_INTERACTIVE)
+    return -1;
+  acquire(&ptable.lock);
+  old = p->policy;
+  p->policy = policy;
+  p->vruntime = ptable.rq[p->cpu].minvrt;
+  if(p->slice > slice(p))
+    p->slice = slice(p);
+  release(&ptable.lock);
+  return old;
+}
+
+int
+sys_setsched(void)
+{
+  int policy;
+
+  if(argint(0, &policy) < 0)
+    return -1;
+  return setsched(policy);
+}
+
+// Set the timeslice at nice 0 to ticks, for slices handed out from
+// now on. Returns the previous value, or -1 if ticks is out of range.
+// ticks 0 leaves it unchanged.
+int
+setquantum(int ticks)
+{
+  int old;
+
+  if(ticks < 0 || ticks > MAXQUANTUM)
+    return -1;
+  acquire(&ptable.lock);
+  old = quantum;
+  if(ticks)
+    quantum = ticks;
+  release(&ptable.lock);
+  return old;
+}
+
+int
+sys_setquantum(void)
+{
+  int ticks;
+
+  if(argint(0, &ticks) < 0)
+    return -1;
+  return setquantum(ticks);
+}
+
 // A fork child's very first scheduling by scheduler()
 // will swtch here.  "Return" to user space.
 void
@@ -417,11 +1199,31 @@ forkret(void)
     first = 0;
     iinit(ROOTDEV);
     initlog(ROOTDEV);
+
+    // Before any user code can call nsleep() or read the clock.
+    clockinit();
+
+    // Kernel threads start here, since those that use
+    // the file system need the log recovered first.
+    wbinit();
+    ksminit();
+    shminit();
+    ringinit();
+    futexinit();
   }
 
   // Return to "caller", actually trapret (see allocproc).
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch here. "Return" to the thread function (see kthread).
+static void
+kthreadret(void)
+{
+  // Still holding ptable.lock from scheduler.
+  release(&ptable.lock);
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
@@ -448,6 +1250,11 @@ sleep(void *chan, struct spinlock *lk)
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->vcsw++;
+  p->sleepprev = SLEEPQ(chan);
+  if((p->sleepnext = *p->sleepprev) != 0)
+    p->sleepnext->sleepprev = &p->sleepnext;
+  *p->sleepprev = p;
 
   sched();
 
@@ -467,11 +1274,13 @@ sleep(void *chan, struct spinlock *lk)
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
+  struct proc *p, *next;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan)
-      p->state = RUNNABLE;
+  for(p = *SLEEPQ(chan); p; p = next){
+    next = p->sleepnext;
+    if(p->chan == chan)
+      runnable(p);  // Takes p off the sleep queue
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -497,7 +1306,7 @@ kill(int pid)
       p->killed = 1;
       // Wake process from sleep if necessary.
       if(p->state == SLEEPING)
-        p->state = RUNNABLE;
+        runnable(p);
       release(&ptable.lock);
       return 0;
     }
@@ -512,16 +1321,159 @@ int nice(int value)
 	struct proc *p = myproc();
 	acquire(&ptable.lock);
 	new_nice = p->nice + value;
-	if ( new_nice > 4 )
-		new_nice = 4;
-	else if (new_nice < -5 )
-		new_nice = -5;
+	if ( new_nice > NICE_MAX )
+		new_nice = NICE_MAX;
+	else if (new_nice < NICE_MIN )
+		new_nice = NICE_MIN;
 	p->nice = new_nice;
+	if ( p->slice > slice(p) )
+		p->slice = slice(p);
 	release(&ptable.lock);
 
 	return p->nice;
 }
 
+// Allow process pid to run only on the CPUs in mask, bit i for
+// cpus[i]. A queued or running process moves the next time it is
+// scheduled. Returns 0, or -1 if there is no such process or mask
+// names no CPU.
+int
+setaffinity(int pid, uint mask)
+{
+  struct proc *p;
+
+  if(ncpu < 32)
+    mask &= (1 << ncpu) - 1;
+  if(mask == 0)
+    return -1;
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid && p->state != UNUSED && p->state != ZOMBIE){
+      p->affinity = mask;
+      release(&ptable.lock);
+      if(p == myproc() && !(mask & (1 << p->cpu)))
+        yield();  // Move now
+      return 0;
+    }
+  }
+  release(&ptable.lock);
+  return -1;
+}
+
+int
+sys_setaffinity(void)
+{
+  int pid, mask;
+
+  if(argint(0, &pid) < 0 || argint(1, &mask) < 0)
+    return -1;
+  return setaffinity(pid, mask);
+}
+
+// Copy the counters of the process with the smallest pid of at
+// least pid into st. Returns its pid, or -1 if there is none, so
+// that callers can walk all processes.
+int
+getprocstats(int pid, struct procstat *st)
+{
+  struct proc *p, *best = 0;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->state == UNUSED || p->pid < pid)
+      continue;
+    if(best == 0 || p->pid < best->pid)
+      best = p;
+  }
+  if(best == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  p = best;
+  st->pid = p->pid;
+  st->state = p->state;
+  st->nice = p->nice;
+  st->cpu = p->cpu;
+  safestrcpy(st->name, p->name, sizeof(st->name));
+  st->cputicks = p->cputicks;
+  st->waitticks = p->waitticks;
+  if(p->state == RUNNABLE)
+    st->waitticks += ticks - p->readytick;
+  st->vcsw = p->vcsw;
+  st->ivcsw = p->ivcsw;
+  st->migrations = p->migrations;
+  st->cowfaults = p->cowfaults;
+  st->mmapfaults = p->mmapfaults;
+  st->zerofaults = p->zerofaults;
+  st->syscalls = p->syscalls;
+  release(&ptable.lock);
+  return st->pid;
+}
+
+int
+sys_getprocstats(void)
+{
+  struct procstat *st;
+  int pid;
+
+  if(argint(0, &pid) < 0 || argptr(1, (char**)&st, sizeof(*st)) < 0)
+    return -1;
+  return getprocstats(pid, st);
+}
+
+// Copy the statistics of up to n CPUs into st.
+// Returns the number of CPUs.
+int
+sys_getcpustats(void)
+{
+  struct cpustat *st;
+  struct cpu *c;
+  int n, i;
+
+  if(argint(1, &n) < 0 || n < 0)
+    return -1;
+  if(n > ncpu)
+    n = ncpu;  // Also keeps n * sizeof(*st) from overflowing
+  if(argptr(0, (char**)&st, n * sizeof(*st)) < 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    c = &cpus[i];
+    st[i].switches = c->switches;
+    st[i].halts = c->halts;
+    st[i].wakeups = c->wakeups;
+    st[i].idleticks = c->idleticks;
+    st[i].busyticks = c->busyticks;
+  }
+  return ncpu;
+}
+
+// Call fn(p, arg) for every process with a page table that is
+// not running on any CPU, with ptable.lock held. Kernel threads
+// use this to edit another process's page table: if p->vm->cpus
+// is 0, no CPU has the table loaded and none can load it until the
+// lock is released, so no stale TLB entry survives. Threads of p
+// may be running otherwise. fn must not sleep.
+// Starts at ptable slot from. If fn returns non-zero, stops and
+// returns p's slot, so that the caller can let go of ptable.lock
+// for a while and resume there. Returns NPROC otherwise.
+int
+procscan(int (*fn)(struct proc*, void*), void *arg, int from)
+{
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for(p = &ptable.proc[from]; p < &ptable.proc[NPROC]; p++){
+    if(p->state != SLEEPING && p->state != RUNNABLE)
+      continue;
+    if(p->pgdir == 0)
+      continue;
+    if(fn(p, arg))
+      break;
+  }
+  release(&ptable.lock);
+  return p - ptable.proc;
+}
+
 //PAGEBREAK: 36
 // Print a process listing to console.  For debugging.
 // Runs when user types ^P on console.
@@ -549,7 +1501,8 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %d %s %s", p->pid, p->nice, state, p->name);
+    cprintf("%d %d %s %s cpu %d mig %d", p->pid, p->nice, state, p->name,
+            p->cpu, p->migrations);
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
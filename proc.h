@@ -8,6 +8,16 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  volatile int tlbreq;         // Another CPU asked this one to flush its TLB (see tlb.c)
+  volatile int idle;           // Halted in scheduler() for lack of work
+  volatile int kicked;         // Work was queued for it since scheduler() last looked
+
+  // Scheduler statistics (see schedstat.h)
+  uint switches;               // Processes switched to
+  uint halts;                  // Times halted with nothing to run
+  uint wakeups;                // T_WAKEUP IPIs received
+  uint idleticks;              // Clock ticks spent in scheduler()
+  uint busyticks;              // Clock ticks spent running a process
 };
 
 extern struct cpu cpus[NCPU];
@@ -41,12 +51,22 @@ struct mmap_area {
   uint length;            // Length of region
   int flags;             // MAP_PROT_READ, MAP_PROT_WRITE
   int used;              // Is this entry in use?
-  int dirty;             // Has this mmap area been written to?
+  int dirty;             // Written since last writeback? Per-page state is in PTE_D
+  uint dirtytick;        // ticks when it last became dirty
 };
 
 #define MAX_MMAPS_PROC  4
 #define MAX_MMAPS_SYS   16
 
+// A free range of the mmap region, [start, end).
+struct mmap_hole {
+  uint start;
+  uint end;
+};
+
+// Every mapping splits at most one hole in two.
+#define MAX_MMAP_HOLES  (MAX_MMAPS_PROC + 1)
+
 // Per-process state
 struct proc {
   uint sz;                     // Size of process memory (bytes)
@@ -55,17 +75,42 @@ struct proc {
   enum procstate state;        // Process state
   int pid;                     // Process ID
   struct proc *parent;         // Parent process
+  struct proc *children;       // Children that haven't exited
+  struct proc *zombies;        // Children that have exited, for wait()
+  struct proc *sibling;        // Next in parent's children or zombies, or in the free list
+  struct proc **siblingprev;   // Points at this proc in that list
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
   int killed;                  // If non-zero, have been killed
   int nice;
+  int slice;                   // Clock ticks left in timeslice (see scheduler())
+  struct proc *rqnext;         // Next on its run queue
+  struct proc *sleepnext;      // Next on its sleep queue, if SLEEPING
+  struct proc **sleepprev;     // Points at this proc in its sleep queue
+  int cpu;                     // CPU it last ran or is queued on
+  uint affinity;               // CPUs it may run on, bit i for cpus[i]
+  int migrations;              // Times it moved to another CPU
+  int policy;                  // SCHED_PRIO, SCHED_FAIR, ... (see sched.h)
+  uint vruntime;               // Weighted ticks run, for SCHED_FAIR
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
 
-  struct mmap_area mmaps[MAX_MMAPS_PROC];
-  uint mmap_sp;                // mmap stack pointer. Starts from KERNBASE and grows downwards
+  // Accounting, for getprocstats()
+  uint cputicks;               // Clock ticks spent running
+  uint waitticks;              // Clock ticks spent RUNNABLE, waiting for a CPU
+  uint readytick;              // ticks when it last became RUNNABLE
+  uint vcsw;                   // Context switches by sleep() or yield()
+  uint ivcsw;                  // Context switches by preemption
+  uint cowfaults;              // Copy-on-write page faults
+  uint mmapfaults;             // Write faults on file mappings
+  uint zerofaults;             // Demand-zero page faults
+  uint syscalls;               // System calls made
+
+  struct vmspace *vm;          // Mappings, shared with threads (see vmspace.h)
+  int ksm;                     // If non-zero, ksmd may merge pages (see ksm.c)
+  uint ksmva;                  // Where ksmd continues scanning
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,140 @@
+//
+// Kernel side of the shared-memory ring channel (see ring.h).
+// The kernel only sets the ring up and puts a side to sleep until
+// the other one has moved head or tail.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+#include "ring.h"
+
+#define RINGMAXPAGES 64
+#define MAP_PROT_READ  1
+#define MAP_PROT_WRITE 2
+
+struct spinlock ringlock;
+
+void
+ringinit(void)
+{
+  initlock(&ringlock, "ring");
+}
+
+// Map a new ring with npages pages of data, a power of two, into
+// the current process. Returns its address, or -1.
+int
+ringcreate(int npages)
+{
+  char *pages[1 + RINGMAXPAGES];
+  int i, n, addr;
+
+  if(npages <= 0 || npages > RINGMAXPAGES || (npages & (npages - 1)))
+    return -1;
+  n = 1 + npages;
+  for(i = 0; i < n; i++){
+    if((pages[i] = kalloc()) == 0){
+      while(--i >= 0)
+        kfree(pages[i]);
+      return -1;
+    }
+    memset(pages[i], 0, PGSIZE);
+  }
+  ((struct ring*)pages[0])->size = npages * PGSIZE;
+
+  addr = mmap_pages(0, pages, n, MAP_PROT_READ | MAP_PROT_WRITE);
+  for(i = 0; i < n; i++)
+    kfree(pages[i]);  // The mapping holds its own references
+  return addr;
+}
+
+// Kernel address of the header of the ring at user address r.
+static struct ring*
+ringhdr(struct proc *p, uint r)
+{
+  pte_t *pte;
+
+  if(r % PGSIZE != 0 || r >= KERNBASE)
+    return 0;
+  if((pte = walkpgdir2(p->pgdir, (void*)r, 0)) == 0)
+    return 0;
+  if((*pte & (PTE_P | PTE_U)) != (PTE_P | PTE_U))
+    return 0;
+  return (struct ring*)P2V(PTE_ADDR(*pte));
+}
+
+// Sleep while the ring is empty (RING_READER) or full (RING_WRITER).
+// The condition is checked under ringlock, which ringwake() takes
+// too, so a wakeup between the caller's check and the sleep isn't
+// lost. The header is read through its kernel address, so the
+// check can't fault while holding the lock.
+int
+ringwait(uint r, int who)
+{
+  struct proc *p = myproc();
+  struct ring *kr;
+
+  if((kr = ringhdr(p, r)) == 0)
+    return -1;
+  acquire(&ringlock);
+  for(;;){
+    if(who == RING_READER && kr->head != kr->tail)
+      break;
+    if(who == RING_WRITER && kr->head - kr->tail != kr->size)
+      break;
+    if(p->killed){
+      release(&ringlock);
+      return -1;
+    }
+    sleep(kr, &ringlock);
+  }
+  release(&ringlock);
+  return 0;
+}
+
+int
+ringwake(uint r)
+{
+  struct ring *kr;
+
+  if((kr = ringhdr(myproc(), r)) == 0)
+    return -1;
+  acquire(&ringlock);
+  wakeup(kr);
+  release(&ringlock);
+  return 0;
+}
+
+int
+sys_ringcreate(void)
+{
+  int npages;
+
+  if(argint(0, &npages) < 0)
+    return -1;
+  return ringcreate(npages);
+}
+
+int
+sys_ringwait(void)
+{
+  int r, who;
+
+  if(argint(0, &r) < 0 || argint(1, &who) < 0)
+    return -1;
+  return ringwait(r, who);
+}
+
+int
+sys_ringwake(void)
+{
+  int r;
+
+  if(argint(0, &r) < 0)
+    return -1;
+  return ringwake(r);
+}
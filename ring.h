@@ -0,0 +1,21 @@
+// Single-producer, single-consumer byte ring shared by two
+// processes. ringcreate() maps a header page followed by the data
+// pages; fork() shares the mapping with the child. Data moves with
+// plain loads and stores. head and tail only grow, and head - tail
+// bytes are in the ring. A side that finds the ring empty (reader)
+// or full (writer) sets its wait flag and calls ringwait(); the
+// other side calls ringwake() after moving head or tail if it sees
+// the flag set.
+struct ring {
+  volatile uint head;   // Bytes written; changed by the writer only
+  volatile uint tail;   // Bytes read; changed by the reader only
+  volatile uint rwait;  // Reader is sleeping, or about to
+  volatile uint wwait;  // Writer is sleeping, or about to
+  uint size;            // Bytes of data, a power of two
+};
+
+#define RINGHDR      4096  // Size of the header page
+#define RINGDATA(r)  ((char*)(r) + RINGHDR)
+
+#define RING_READER  0     // ringwait(): sleep while the ring is empty
+#define RING_WRITER  1     // ringwait(): sleep while the ring is full
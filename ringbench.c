@@ -0,0 +1,120 @@
+// Compare small-message throughput of a shared-memory ring
+// (see ring.h) with a pipe. A child writes NMSG messages of MSGSZ
+// bytes each; the parent reads them.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "ring.h"
+
+#define NMSG  100000
+#define MSGSZ 16
+
+static void
+ringput(struct ring *r, char *buf, int n)
+{
+  char *data = RINGDATA(r);
+
+  while(n > 0){
+    while(r->head - r->tail == r->size){
+      r->wwait = 1;
+      __sync_synchronize();
+      if(r->head - r->tail == r->size)
+        ringwait(r, RING_WRITER);
+      r->wwait = 0;
+    }
+    data[r->head & (r->size - 1)] = *buf++;
+    r->head++;
+    n--;
+  }
+  __sync_synchronize();  // Publish head before looking at rwait
+  if(r->rwait)
+    ringwake(r);
+}
+
+static void
+ringget(struct ring *r, char *buf, int n)
+{
+  char *data = RINGDATA(r);
+
+  while(n > 0){
+    while(r->head == r->tail){
+      r->rwait = 1;
+      __sync_synchronize();
+      if(r->head == r->tail)
+        ringwait(r, RING_READER);
+      r->rwait = 0;
+    }
+    *buf++ = data[r->tail & (r->size - 1)];
+    r->tail++;
+    n--;
+  }
+  __sync_synchronize();  // Publish tail before looking at wwait
+  if(r->wwait)
+    ringwake(r);
+}
+
+static int
+benchring(void)
+{
+  char msg[MSGSZ];
+  struct ring *r;
+  int i, t0;
+
+  if((r = ringcreate(4)) == (struct ring*)-1){
+    printf(1, "ringbench: ringcreate failed\n");
+    exit();
+  }
+  t0 = uptime();
+  if(fork() == 0){
+    memset(msg, 'r', MSGSZ);
+    for(i = 0; i < NMSG; i++)
+      ringput(r, msg, MSGSZ);
+    exit();
+  }
+  for(i = 0; i < NMSG; i++)
+    ringget(r, msg, MSGSZ);
+  wait();
+  munmap(r, RINGHDR + r->size);
+  return uptime() - t0;
+}
+
+static int
+benchpipe(void)
+{
+  char msg[MSGSZ];
+  int fds[2], i, n, t0;
+
+  if(pipe(fds) < 0){
+    printf(1, "ringbench: pipe failed\n");
+    exit();
+  }
+  t0 = uptime();
+  if(fork() == 0){
+    close(fds[0]);
+    memset(msg, 'p', MSGSZ);
+    for(i = 0; i < NMSG; i++)
+      write(fds[1], msg, MSGSZ);
+    exit();
+  }
+  close(fds[1]);
+  for(i = 0; i < NMSG; i++)
+    for(n = 0; n < MSGSZ; )
+      n += read(fds[0], msg + n, MSGSZ - n);
+  close(fds[0]);
+  wait();
+  return uptime() - t0;
+}
+
+int
+main(void)
+{
+  int tring, tpipe;
+
+  tpipe = benchpipe();
+  tring = benchring();
+  printf(1, "%d messages of %d bytes\n", NMSG, MSGSZ);
+  printf(1, "pipe: %d ticks\n", tpipe);
+  printf(1, "ring: %d ticks\n", tring);
+  exit();
+}
@@ -0,0 +1,5 @@
+// Scheduling policies, for setsched().
+#define SCHED_PRIO   0   // Run queue per nice value, lowest nice first
+#define SCHED_FAIR   1   // CPU shared in proportion to a weight from nice
+#define SCHED_BATCH  2   // Like SCHED_PRIO, with long slices
+#define SCHED_INTERACTIVE 3  // Like SCHED_PRIO, with short slices; preempts batch
@@ -0,0 +1,61 @@
+// Scheduler scalability: run n CPU-bound and n yield-heavy
+// processes at once and report how long all of them take.
+// Run it with "schedbench n" under CPUS=1, 2, 4 and 8 and compare.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define SPINS   (1 << 25)   // loop iterations per CPU-bound process
+#define YIELDS  20000       // yield() calls per yield-heavy process
+
+static void
+spinner(void)
+{
+  volatile uint x = 0;
+  uint i;
+
+  for(i = 0; i < SPINS; i++)
+    x += i;
+  exit();
+}
+
+static void
+yielder(void)
+{
+  int i;
+
+  for(i = 0; i < YIELDS; i++)
+    yield();
+  exit();
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, pid, t0;
+
+  n = argc > 1 ? atoi(argv[1]) : 4;
+  if(n < 1){
+    printf(2, "usage: schedbench [n]\n");
+    exit();
+  }
+
+  t0 = uptime();
+  for(i = 0; i < 2 * n; i++){
+    if((pid = fork()) < 0){
+      printf(1, "schedbench: fork failed\n");
+      break;
+    }
+    if(pid == 0){
+      if(i < n)
+        spinner();
+      else
+        yielder();
+    }
+  }
+  while(wait() >= 0)
+    ;
+  printf(1, "%d spinners, %d yielders: %d ticks\n", n, n, uptime() - t0);
+  exit();
+}
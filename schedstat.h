@@ -0,0 +1,26 @@
+// Scheduler statistics of one CPU, from getcpustats().
+struct cpustat {
+  uint switches;    // Processes switched to
+  uint halts;       // Times halted with nothing to run
+  uint wakeups;     // Wakeup IPIs received while halted
+  uint idleticks;   // Clock ticks that found it idle
+  uint busyticks;   // Clock ticks that found it running a process
+};
+
+// Counters of one process, from getprocstats().
+struct procstat {
+  int pid;
+  int state;        // enum procstate
+  int nice;
+  int cpu;          // CPU it last ran on
+  char name[16];
+  uint cputicks;    // Clock ticks spent running
+  uint waitticks;   // Clock ticks spent runnable, waiting for a CPU
+  uint vcsw;        // Context switches by sleeping or yielding
+  uint ivcsw;       // Context switches by preemption
+  uint migrations;  // Moves to another CPU
+  uint cowfaults;   // Copy-on-write page faults
+  uint mmapfaults;  // Write faults on file mappings
+  uint zerofaults;  // Demand-zero page faults
+  uint syscalls;    // System calls made
+};
@@ -0,0 +1,73 @@
+// CPU shares under SCHED_FAIR. Two CPU-bound children at nice 0
+// and nice 2 (weights 1024 and 655) run for DURATION ticks; the
+// first should get about 61% of the loop iterations. Both are
+// kept on CPU 0 so that they compete.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "sched.h"
+
+#define DURATION 300
+
+static void
+spin(int fd, int t0, int id)
+{
+  uint msg[2];
+  volatile int x = 0;
+  int i;
+
+  msg[0] = id;
+  msg[1] = 0;
+  while(uptime() < t0 + DURATION){
+    for(i = 0; i < 1000; i++)
+      x++;
+    msg[1]++;
+  }
+  write(fd, msg, sizeof(msg));
+  exit();
+}
+
+int
+main(void)
+{
+  int fds[2], t0, pct;
+  uint n[2], msg[2];
+  int i;
+
+  if(setsched(SCHED_FAIR) < 0){
+    printf(1, "sharetest: setsched failed\n");
+    exit();
+  }
+  nice(2 - nice(0));  // Start from nice 2
+  setaffinity(getpid(), 1);
+  if(pipe(fds) < 0){
+    printf(1, "sharetest: pipe failed\n");
+    exit();
+  }
+  t0 = uptime() + 1;
+  for(i = 0; i < 2; i++){
+    if(fork() == 0){
+      if(i == 0)
+        nice(-2);  // nice 0
+      spin(fds[1], t0, i);
+    }
+  }
+  close(fds[1]);
+  for(i = 0; i < 2; i++){
+    if(read(fds[0], msg, sizeof(msg)) != sizeof(msg) || msg[0] > 1){
+      printf(1, "sharetest: bad report\n");
+      exit();
+    }
+    n[msg[0]] = msg[1];
+  }
+  wait();
+  wait();
+  pct = n[0] / ((n[0] + n[1]) / 100 + 1);
+  printf(1, "nice 0: %d%%, nice 2: %d%%\n", pct, 100 - pct);
+  if(pct >= 55 && pct <= 67)
+    printf(1, "sharetest ok\n");
+  else
+    printf(1, "sharetest FAILED: expected about 61%%\n");
+  exit();
+}
@@ -0,0 +1,178 @@
+//
+// Named shared memory segments.
+//
+// shmopen() creates or looks up a segment by key and returns its
+// id. shmmap() maps the segment's frames into the caller as a
+// shared anonymous mapping, so every process that maps it sees the
+// same memory without copying; munmap() unmaps it. shmunlink()
+// removes the key. The segment holds one reference on each frame,
+// and each mapping another, so the memory lives until the key is
+// removed and the last mapping is gone.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "spinlock.h"
+
+#define NSHM        16   // maximum number of segments
+#define SHMMAXPAGES 64   // maximum size of a segment in pages
+
+#define SHM_CREAT   1    // Create the segment if the key is new
+#define SHM_EXCL    2    // With SHM_CREAT, fail if the key exists
+
+struct shmseg {
+  int key;
+  int npages;        // 0 if slot is free
+  char *pages[SHMMAXPAGES];
+};
+
+struct {
+  struct spinlock lock;
+  struct shmseg seg[NSHM];
+} shmtab;
+
+void
+shminit(void)
+{
+  initlock(&shmtab.lock, "shm");
+}
+
+static struct shmseg*
+shmlookup(int key)
+{
+  struct shmseg *s;
+
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++)
+    if(s->npages && s->key == key)
+      return s;
+  return 0;
+}
+
+// Return the id of the segment key, creating it with size bytes of
+// zeroed memory if flags has SHM_CREAT. An existing segment must be
+// at least size bytes.
+int
+shmopen(int key, int size, int flags)
+{
+  struct shmseg *s;
+  int i, n;
+
+  n = PGROUNDUP(size) / PGSIZE;
+  if(size < 0 || n > SHMMAXPAGES)
+    return -1;
+
+  acquire(&shmtab.lock);
+  if((s = shmlookup(key)) != 0){
+    if(((flags & SHM_CREAT) && (flags & SHM_EXCL)) || n > s->npages)
+      goto bad;
+    release(&shmtab.lock);
+    return s - shmtab.seg;
+  }
+  if(!(flags & SHM_CREAT) || n == 0)
+    goto bad;
+  for(s = shmtab.seg; s < &shmtab.seg[NSHM]; s++)
+    if(s->npages == 0)
+      break;
+  if(s == &shmtab.seg[NSHM])
+    goto bad;
+
+  for(i = 0; i < n; i++){
+    if((s->pages[i] = kalloc()) == 0){
+      while(--i >= 0)
+        kfree(s->pages[i]);
+      goto bad;
+    }
+    memset(s->pages[i], 0, PGSIZE);
+  }
+  s->key = key;
+  s->npages = n;
+  release(&shmtab.lock);
+  return s - shmtab.seg;
+
+bad:
+  release(&shmtab.lock);
+  return -1;
+}
+
+// Map segment id at addr, or anywhere if addr is 0.
+// Returns the address, or -1.
+int
+shmmap(int id, uint addr, int prot)
+{
+  char *pages[SHMMAXPAGES];
+  struct shmseg *s;
+  int i, n;
+  int r;
+
+  if(id < 0 || id >= NSHM)
+    return -1;
+  // mmap_pages() sleeps, so hold the frames while shmtab is unlocked
+  // in case the key is removed meanwhile.
+  acquire(&shmtab.lock);
+  s = &shmtab.seg[id];
+  n = s->npages;
+  for(i = 0; i < n; i++){
+    pages[i] = s->pages[i];
+    kdup(pages[i]);
+  }
+  release(&shmtab.lock);
+  if(n == 0)
+    return -1;
+  r = mmap_pages(addr, pages, n, prot);
+  for(i = 0; i < n; i++)
+    kfree(pages[i]);
+  return r;
+}
+
+// Remove key. Processes that have the segment mapped keep it.
+int
+shmunlink(int key)
+{
+  struct shmseg *s;
+  int i;
+
+  acquire(&shmtab.lock);
+  if((s = shmlookup(key)) == 0){
+    release(&shmtab.lock);
+    return -1;
+  }
+  for(i = 0; i < s->npages; i++)
+    kfree(s->pages[i]);
+  s->npages = 0;
+  release(&shmtab.lock);
+  return 0;
+}
+
+int
+sys_shmopen(void)
+{
+  int key, size, flags;
+
+  if(argint(0, &key) < 0 || argint(1, &size) < 0 || argint(2, &flags) < 0)
+    return -1;
+  return shmopen(key, size, flags);
+}
+
+int
+sys_shmmap(void)
+{
+  int id, addr, prot;
+
+  if(argint(0, &id) < 0 || argint(1, &addr) < 0 || argint(2, &prot) < 0)
+    return -1;
+  return shmmap(id, addr, prot);
+}
+
+int
+sys_shmunlink(void)
+{
+  int key;
+
+  if(argint(0, &key) < 0)
+    return -1;
+  return shmunlink(key);
+}
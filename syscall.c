@@ -5,6 +5,9 @@
 #include "mmu.h"
 #include "proc.h"
 #include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
 #include "syscall.h"
 
 // User code makes a system call with INT T_SYSCALL.
@@ -67,7 +70,10 @@ argptr(int n, char **pp, int size)
     return -1;
   // Modified to allow write() for mmap areas;
   int in_heap = (uint)i < curproc->sz && (uint)i+size <= curproc->sz; // Less than heap max (stored in sz)
-  int in_mmap = (uint)i >= curproc->mmap_sp && (uint)i+size < KERNBASE;  // In the mmap areas
+  int in_mmap = 0;  // Inside one mmap area. The region below KERNBASE also has unmapped holes.
+  for(struct mmap_area *ma = curproc->vm->mmaps; ma < &curproc->vm->mmaps[MAX_MMAPS_PROC]; ma++)
+    if(ma->used && (uint)i >= ma->addr && (uint)i+size <= ma->addr + ma->length && (uint)i+size >= (uint)i)
+      in_mmap = 1;
   if(in_heap || in_mmap){
     *pp = (char*)i;
     return 0;
@@ -116,6 +122,29 @@ extern int sys_yield(void);
 extern int sys_frees(void);
 extern int sys_mmap(void);
 extern int sys_munmap(void);
+extern int sys_msync(void);
+extern int sys_mremap(void);
+extern int sys_mprotect(void);
+extern int sys_mlock(void);
+extern int sys_munlock(void);
+extern int sys_memstat(void);
+extern int sys_ksm(void);
+extern int sys_shmopen(void);
+extern int sys_shmmap(void);
+extern int sys_shmunlink(void);
+extern int sys_ringcreate(void);
+extern int sys_ringwait(void);
+extern int sys_ringwake(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_clone(void);
+extern int sys_setsched(void);
+extern int sys_setaffinity(void);
+extern int sys_getcpustats(void);
+extern int sys_getprocstats(void);
+extern int sys_setquantum(void);
+extern int sys_nanotime(void);
+extern int sys_nsleep(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -146,6 +175,29 @@ static int (*syscalls[])(void) = {
 [SYS_frees] sys_frees,
 [SYS_mmap] sys_mmap,
 [SYS_munmap] sys_munmap,
+[SYS_msync] sys_msync,
+[SYS_mremap] sys_mremap,
+[SYS_mprotect] sys_mprotect,
+[SYS_mlock] sys_mlock,
+[SYS_munlock] sys_munlock,
+[SYS_memstat] sys_memstat,
+[SYS_ksm] sys_ksm,
+[SYS_shmopen] sys_shmopen,
+[SYS_shmmap] sys_shmmap,
+[SYS_shmunlink] sys_shmunlink,
+[SYS_ringcreate] sys_ringcreate,
+[SYS_ringwait] sys_ringwait,
+[SYS_ringwake] sys_ringwake,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_clone]   sys_clone,
+[SYS_setsched] sys_setsched,
+[SYS_setaffinity] sys_setaffinity,
+[SYS_getcpustats] sys_getcpustats,
+[SYS_getprocstats] sys_getprocstats,
+[SYS_setquantum] sys_setquantum,
+[SYS_nanotime] sys_nanotime,
+[SYS_nsleep] sys_nsleep,
 };
 
 void
@@ -155,6 +207,7 @@ syscall(void)
   struct proc *curproc = myproc();
 
   num = curproc->tf->eax;
+  curproc->syscalls++;
   if(num > 0 && num < NELEM(syscalls) && syscalls[num]) {
     curproc->tf->eax = syscalls[num]();
   } else {
@@ -13,14 +13,23 @@
 #include "fs.h"
 #include "spinlock.h"
 #include "sleeplock.h"
+#include "vmspace.h"
 #include "file.h"
 #include "fcntl.h"
 
 // For mmap
 #include "memlayout.h"
 #include "x86.h"
+#define MAP_PROT_NONE  0x00000000  // mprotect() only
 #define MAP_PROT_READ  0x00000001
 #define MAP_PROT_WRITE 0x00000002
+#define MAP_ANONYMOUS  0x00000004
+#define MAP_SHARED     0x00000008  // Default. Shared with fork children; file writes reach the file
+#define MAP_PRIVATE    0x00000010  // Copy-on-write after fork; file writes never reach the file
+#define MAP_POPULATE   0x00000020  // Map anonymous pages now instead of on first access
+#define MREMAP_MAYMOVE 0x00000001
+#define MS_ASYNC       0x00000001
+#define MS_SYNC        0x00000004
 int num_system_mmap_areas = 0;
 
 // Fetch the nth word-sized system call argument as a file descriptor
@@ -474,13 +483,194 @@ int sys_swapwrite(void)
 	return 0;
 }
 
+// The mmap region lies between the heap and KERNBASE - PGSIZE.
+// Free ranges are kept in p->vm->holes[], sorted by address and
+// coalesced on free. The heap may grow into the lowest hole, so
+// the part of a hole below p->sz is never handed out.
+
+// Take len bytes from the smallest hole they fit in (best fit),
+// from the top of the hole. Returns the address, or 0 if none fits.
+static uint
+mmap_alloc_range(struct proc *p, uint len)
+{
+  struct mmap_hole *h, *best = 0;
+  uint start, size, bestsize = 0, addr;
+
+  len = PGROUNDUP(len);
+  for (h = p->vm->holes; h < &p->vm->holes[p->vm->nholes]; h++)
+  {
+    start = h->start;
+    if (start < PGROUNDUP(p->sz))
+      start = PGROUNDUP(p->sz);
+    if (start >= h->end)
+      continue;
+    size = h->end - start;
+    if (size >= len && (best == 0 || size < bestsize))
+    {
+      best = h;
+      bestsize = size;
+    }
+  }
+  if (best == 0)
+    return 0;
+
+  addr = best->end - len;
+  best->end = addr;
+  if (best->start == best->end) // Hole used up. Remove it.
+  {
+    for (h = best; h + 1 < &p->vm->holes[p->vm->nholes]; h++)
+      *h = *(h + 1);
+    p->vm->nholes--;
+  }
+  return addr;
+}
+
+// Take exactly [addr, addr + len) out of the hole that contains it.
+// Returns 0, or -1 if the range isn't free.
+static int
+mmap_take_range(struct proc *p, uint addr, uint len)
+{
+  uint end = addr + PGROUNDUP(len);
+  struct mmap_hole *h;
+  int i;
+
+  if (addr < PGROUNDUP(p->sz) || end < addr)
+    return -1;
+  for (i = 0; i < p->vm->nholes; i++)
+    if (p->vm->holes[i].start <= addr && end <= p->vm->holes[i].end)
+      break;
+  if (i == p->vm->nholes)
+    return -1;
+
+  h = &p->vm->holes[i];
+  if (h->start == addr && h->end == end)
+  {
+    for (; h + 1 < &p->vm->holes[p->vm->nholes]; h++)
+      *h = *(h + 1);
+    p->vm->nholes--;
+  }
+  else if (h->start == addr)
+    h->start = end;
+  else if (h->end == end)
+    h->end = addr;
+  else
+  {
+    if (p->vm->nholes == MAX_MMAP_HOLES)
+      return -1;
+    for (h = &p->vm->holes[p->vm->nholes]; h > &p->vm->holes[i + 1]; h--)
+      *h = *(h - 1);
+    p->vm->holes[i + 1].start = end;
+    p->vm->holes[i + 1].end = p->vm->holes[i].end;
+    p->vm->holes[i].end = addr;
+    p->vm->nholes++;
+  }
+  return 0;
+}
+
+// Give [addr, addr + len) back, merging it with adjacent holes.
+static void
+mmap_free_range(struct proc *p, uint addr, uint len)
+{
+  uint end = addr + PGROUNDUP(len);
+  struct mmap_hole *h;
+  int i;
+
+  // Find the first hole above the range.
+  for (i = 0; i < p->vm->nholes; i++)
+    if (p->vm->holes[i].start >= end)
+      break;
+
+  int prev = i > 0 && p->vm->holes[i - 1].end == addr;
+  int next = i < p->vm->nholes && p->vm->holes[i].start == end;
+  if (prev && next)
+  {
+    p->vm->holes[i - 1].end = p->vm->holes[i].end;
+    for (h = &p->vm->holes[i]; h + 1 < &p->vm->holes[p->vm->nholes]; h++)
+      *h = *(h + 1);
+    p->vm->nholes--;
+  }
+  else if (prev)
+    p->vm->holes[i - 1].end = end;
+  else if (next)
+    p->vm->holes[i].start = addr;
+  else
+  {
+    if (p->vm->nholes == MAX_MMAP_HOLES)
+      panic("mmap_free_range");
+    for (h = &p->vm->holes[p->vm->nholes]; h > &p->vm->holes[i]; h--)
+      *h = *(h - 1);
+    p->vm->holes[i].start = addr;
+    p->vm->holes[i].end = end;
+    p->vm->nholes++;
+  }
+}
+
+// mmap_sp is the lowest mapped address. growproc() keeps the heap below it.
+static void
+mmap_update_sp(struct proc *p)
+{
+  uint min = KERNBASE - PGSIZE;
+  for (int j = 0; j < MAX_MMAPS_PROC; j++)
+  {
+    if (p->vm->mmaps[j].used && min > p->vm->mmaps[j].addr)
+      min = p->vm->mmaps[j].addr;
+  }
+  p->vm->mmap_sp = min;
+}
+
+// Map a zeroed page at every missing page of anonymous mapping ma
+// in [start, end), as trap() does on first access. Only missing
+// entries change, so no TLB entry needs to be flushed.
+// Returns -1 if memory ran out; pages mapped so far stay mapped.
+static int
+mmap_populate(struct proc *p, struct mmap_area *ma, uint start, uint end)
+{
+  pte_t *pte;
+  char *mem;
+  uint va;
+  int r = 0;
+
+  acquire(&p->vm->ptlock); // Other threads may fault on these pages
+  for (va = start; va < end; va += PGSIZE)
+  {
+    pte = walkpgdir2(p->pgdir, (void*)va, 0);
+    if (pte && (*pte & PTE_P))
+      continue;
+    if ((mem = kalloc()) == 0)
+    {
+      r = -1;
+      break;
+    }
+    memset(mem, 0, PGSIZE);
+    if ((pte = walkpgdir2(p->pgdir, (void*)va, 1)) == 0)
+    {
+      kfree(mem);
+      r = -1;
+      break;
+    }
+    if (*pte & PTE_WP) // Keep the protection set by mprotect()
+      *pte = V2P(mem) | PTE_P | (*pte & (PTE_WP | PTE_U));
+    else
+    {
+      *pte = V2P(mem) | PTE_P | PTE_U;
+      if (ma->flags & MAP_PROT_WRITE)
+        *pte |= PTE_W;
+    }
+  }
+  release(&p->vm->ptlock);
+  return r;
+}
+
 int mmap(struct file* f, int off, int len, int flags)
 {
   struct proc *p = myproc();
   int i;
   
   // 1. Handle errors
-  if(!f || f->readable == 0)
+  if(flags & MAP_ANONYMOUS){
+    f = 0;      // Anonymous mappings have no file and start at offset 0
+    off = 0;
+  } else if(!f || f->readable == 0)
     return -1;    
   if(off % PGSIZE != 0)
     return -1;
@@ -488,6 +678,8 @@ int mmap(struct file* f, int off, int len, int flags)
     return -1;
   if(!(flags & (MAP_PROT_READ | MAP_PROT_WRITE))) // If flags has no read bit and no write bit.
     return -1;
+  if((flags & MAP_SHARED) && (flags & MAP_PRIVATE))
+    return -1;
   if(num_system_mmap_areas == MAX_MMAPS_SYS) // If number of areas is maximum
     return -1;
   
@@ -495,7 +687,7 @@ int mmap(struct file* f, int off, int len, int flags)
   i = 0;
   while (i < MAX_MMAPS_PROC)
   {
-    if (!p->mmaps[i].used)
+    if (!p->vm->mmaps[i].used)
       break;
 
     i++;
@@ -504,48 +696,145 @@ int mmap(struct file* f, int off, int len, int flags)
     return -1;
 
   // 3. Allocate mmap to process
-  uint addr = p->mmap_sp - len;
-  addr = PGROUNDDOWN(addr);
-  if(allocuvm(p->pgdir, addr, addr + len) == 0){
+  uint addr = mmap_alloc_range(p, len);
+  if(addr == 0)
     return -1;
-  }
+  if(f)
+  {
+    if(allocuvm(p->pgdir, addr, addr + len) == 0){
+      mmap_free_range(p, addr, len);
+      return -1;
+    }
   
-  // 4. Copy file data to mmap area
-  f->off += off; // Add offset
-  if (fileread(f, (char *)addr, len) == 0){ // Read file into addr
-    return -1;
-  }
+    // 4. Copy file data to mmap area
+    f->off += off; // Add offset
+    if (fileread(f, (char *)addr, len) == 0){ // Read file into addr
+      tlbunmap(p, addr, addr + len);
+      mmap_free_range(p, addr, len);
+      return -1;
+    }
 
-  // 5. Find PTE
-  for(uint va = PGROUNDDOWN(addr); va < PGROUNDUP(addr + len); va += PGSIZE) {
-    pte_t *pte = walkpgdir2(p->pgdir, (void*)va, 0);
-    if(pte)
-      *pte &= ~PTE_W; // Set read-only temporarily. Trap on first write.  
+    // 5. Find PTE
+    for(uint va = PGROUNDDOWN(addr); va < PGROUNDUP(addr + len); va += PGSIZE) {
+      pte_t *pte = walkpgdir2(p->pgdir, (void*)va, 0);
+      if(pte)
+        *pte &= ~(PTE_W | PTE_D); // Set read-only temporarily. Trap on first write.
+                                  // fileread() above dirtied the page, so clear PTE_D too.
+    }
+    lcr3(V2P(p->pgdir)); // Update (reset) TLB
   }
-  lcr3(V2P(p->pgdir)); // Update (reset) TLB
+  // Anonymous mappings allocate nothing here. trap() maps a zeroed
+  // page on the first access to each page (demand-zero), unless
+  // MAP_POPULATE asks for all of them now (step 7).
 
   // 6. Update values
-  p->mmaps[i].addr = addr;    
-  p->mmaps[i].file = filedup(f); // increase references
-  p->mmaps[i].offset = off;
-  p->mmaps[i].length = len;
-  p->mmaps[i].flags = flags;
-  p->mmaps[i].used = 1;
-  p->mmaps[i].dirty = 0;
-  p->mmap_sp = addr;
+  if (f)
+    filedup(f); // increase references
+  acquire(&p->vm->ptlock); // trap() reads mmaps[]
+  p->vm->mmaps[i].addr = addr;    
+  p->vm->mmaps[i].file = f;
+  p->vm->mmaps[i].offset = off;
+  p->vm->mmaps[i].length = len;
+  p->vm->mmaps[i].flags = flags;
+  p->vm->mmaps[i].used = 1;
+  p->vm->mmaps[i].dirty = 0;
+  release(&p->vm->ptlock);
+  mmap_update_sp(p);
   num_system_mmap_areas++;
 
-  return p->mmaps[i].addr;
+  // 7. Prefault. File mappings were filled in step 4 already.
+  if (!f && (flags & MAP_POPULATE) && mmap_populate(p, &p->vm->mmaps[i], addr, addr + len) < 0)
+  {
+    munmap((void*)addr, len);
+    return -1;
+  }
+
+  return p->vm->mmaps[i].addr;
 }
 
 int sys_mmap(void)
 {
-	struct file *f;
-	int off, len, flags;
-	if ( argfd(0, 0, &f) < 0 || argint(1, &off) < 0 || 
-			argint(2, &len) < 0 || argint(3, &flags) < 0 )
+	struct file *f = 0;
+	int off, len, flags, r;
+	if ( argint(1, &off) < 0 || argint(2, &len) < 0 || argint(3, &flags) < 0 )
+		return -1;
+	if ( !(flags & MAP_ANONYMOUS) && argfd(0, 0, &f) < 0 )  // fd is ignored for anonymous mappings
 		return -1;
-	return mmap(f, off, len, flags);
+	acquiresleep(&myproc()->vm->lock);
+	r = mmap(f, off, len, flags);
+	releasesleep(&myproc()->vm->lock);
+	return r;
+}
+
+// Map the n frames in pages[] into the current process as one
+// shared anonymous mapping, at addr, or where mmap() would put it
+// if addr is 0. Each frame gets one more reference, which munmap()
+// drops. Used by shm.c and ring.c. Returns the address, or -1.
+int mmap_pages(uint addr, char **pages, int n, int prot)
+{
+  struct proc *p = myproc();
+  uint len = n * PGSIZE, va;
+  pte_t *pte;
+  int i, k;
+
+  // 1. Handle errors
+  if (n <= 0 || addr % PGSIZE != 0)
+    return -1;
+  if (!(prot & (MAP_PROT_READ | MAP_PROT_WRITE)) || (prot & ~(MAP_PROT_READ | MAP_PROT_WRITE)))
+    return -1;
+  acquiresleep(&p->vm->lock);
+  if (num_system_mmap_areas == MAX_MMAPS_SYS)
+    goto bad;
+  for (i = 0; i < MAX_MMAPS_PROC; i++)
+    if (!p->vm->mmaps[i].used)
+      break;
+  if (i == MAX_MMAPS_PROC)
+    goto bad;
+
+  // 2. Take the range
+  if (addr == 0)
+  {
+    if ((addr = mmap_alloc_range(p, len)) == 0)
+      goto bad;
+  }
+  else if (mmap_take_range(p, addr, len) < 0)
+    goto bad;
+
+  // 3. Map the frames. Entries were missing, so no TLB flush.
+  acquire(&p->vm->ptlock);
+  for (k = 0; k < n; k++)
+  {
+    va = addr + k * PGSIZE;
+    if ((pte = walkpgdir2(p->pgdir, (void*)va, 1)) == 0)
+    {
+      deallocuvm(p->pgdir, va, addr);
+      release(&p->vm->ptlock);
+      mmap_free_range(p, addr, len);
+      goto bad;
+    }
+    *pte = V2P(pages[k]) | PTE_P | PTE_U;
+    if (prot & MAP_PROT_WRITE)
+      *pte |= PTE_W;
+    kdup(pages[k]);
+  }
+
+  // 4. Update values
+  p->vm->mmaps[i].addr = addr;
+  p->vm->mmaps[i].file = 0;
+  p->vm->mmaps[i].offset = 0;
+  p->vm->mmaps[i].length = len;
+  p->vm->mmaps[i].flags = prot | MAP_ANONYMOUS | MAP_SHARED;
+  p->vm->mmaps[i].used = 1;
+  p->vm->mmaps[i].dirty = 0;
+  release(&p->vm->ptlock);
+  mmap_update_sp(p);
+  num_system_mmap_areas++;
+  releasesleep(&p->vm->lock);
+  return addr;
+
+bad:
+  releasesleep(&p->vm->lock);
+  return -1;
 }
 
 int munmap(void* addr, int length)
@@ -553,9 +842,6 @@ int munmap(void* addr, int length)
   struct proc *p = myproc();
   uint addr_uint = (uint)addr;
   struct mmap_area *ma;
-  pte_t *pte;
-  char *kernel_va;
-  uint proc_va;
   int i;
 
   // 1. Handle error cases
@@ -564,7 +850,7 @@ int munmap(void* addr, int length)
 
   // 2. Find mmap area
   for (i = 0; i < MAX_MMAPS_PROC; i++) {
-    ma = &p->mmaps[i];
+    ma = &p->vm->mmaps[i];
     if (ma->used && ma->addr == addr_uint)
     {
         if (ma->length == length) // check if length is correct
@@ -576,52 +862,578 @@ int munmap(void* addr, int length)
   if (i == MAX_MMAPS_PROC) // mmap area not found. Return 0 as per pdf
     return 0;
 
-  // 3. Reset new mmap stack pointer. Find min of all mmaps
-  uint min = KERNBASE - PGSIZE;
-  for (int j = 0; j < MAX_MMAPS_PROC; j++)
+  // 3. If dirty, write the modified pages to file
+  if (ma->file && !(ma->flags & MAP_PRIVATE))
   {
-    if (i != j) // skip the mmap we're currently working on
+    if (ma->dirty)
     {
-      if (min > p->mmaps[i].addr)
-        min = p->mmaps[i].addr;
+      mmap_writeback(p, ma, ma->addr, ma->addr + ma->length, 0);
+      ma->dirty = 0;
     }
+    wbwait(ma->file->ip); // Pages queued by msync(MS_ASYNC) must reach the file too
   }
-  p->mmap_sp = min;
 
-  // 4. If dirty, write to file
-  if (ma->dirty)
+  // 4. Update values. Once trap() sees the area gone, it maps nothing more there.
+  acquire(&p->vm->ptlock);
+  num_system_mmap_areas--;
+  ma->used = 0;
+  release(&p->vm->ptlock);
+
+  // 5. Deallocate and free pages. The range becomes a hole that later mmaps can reuse.
+  tlbunmap(p, addr_uint, addr_uint + length);
+  mmap_free_range(p, ma->addr, ma->length);
+  mmap_update_sp(p);
+  if (ma->file)
+  {
+    fileput(ma->file); // drop the reference taken by mmap()
+    ma->file = 0;
+  }
+  return 0;
+}
+
+// Give the child np copies of p's mappings. Shared mappings share
+// their frames outright. Private writable ones share them
+// copy-on-write, as copyuvm() does for the rest of memory.
+// Returns 0, or -1 if np's page table could not be filled in.
+int mmapfork(struct proc *np, struct proc *p)
+{
+  struct mmap_area *ma;
+  pte_t *pte, *npte;
+  uint va;
+  int i, n = 0;
+
+  for (i = 0; i < MAX_MMAPS_PROC; i++)
+    if (p->vm->mmaps[i].used)
+      n++;
+  if (num_system_mmap_areas + n > MAX_MMAPS_SYS)
+    return -1;
+
+  for (ma = p->vm->mmaps; ma < &p->vm->mmaps[MAX_MMAPS_PROC]; ma++)
   {
-    for(int stride = 0; stride < ma->length; stride += PGSIZE) {
-      proc_va = (uint)ma->addr + stride;
-      if((pte = walkpgdir2(p->pgdir, (void*)proc_va, 0)) == 0)
+    if (!ma->used)
+      continue;
+
+    // A shared anonymous page must exist before fork. Otherwise
+    // parent and child would each fault in their own zero page.
+    if (ma->file == 0 && !(ma->flags & MAP_PRIVATE) &&
+        mmap_populate(p, ma, ma->addr, ma->addr + ma->length) < 0)
+      return -1;
+
+    acquire(&p->vm->ptlock); // Other threads of p may fault meanwhile
+    for (va = ma->addr; va < ma->addr + ma->length; va += PGSIZE)
+    {
+      pte = walkpgdir2(p->pgdir, (void*)va, 0);
+      if (pte == 0 || *pte == 0)
+        continue;
+
+      if ((npte = walkpgdir2(np->pgdir, (void*)va, 1)) == 0)
       {
+        release(&p->vm->ptlock);
+        tlbflush(p);
+        return -1;
+      }
+      if (!(*pte & PTE_P))
+      {
+        *npte = *pte; // Only an mprotect() protection
         continue;
       }
+      if (ma->flags & MAP_PRIVATE)
+      {
+        if (ma->flags & MAP_PROT_WRITE)
+          *pte = (*pte & ~PTE_W) | PTE_COW; // Whoever writes first gets a copy (see trap())
+        *npte = *pte;
+      }
+      else if (ma->file)
+        *npte = *pte & ~(PTE_W | PTE_D);    // The child's writes are tracked separately
+      else
+        *npte = *pte;
+      *npte &= ~PTE_LOCK;                   // mlock() is not inherited
+      kdup(P2V(PTE_ADDR(*pte)));            // One more page table refers to the frame
+    }
+    release(&p->vm->ptlock);
+  }
+  tlbflush(p); // Parent's PTEs may have lost PTE_W, here and in copyuvm()
 
-      // Convert to kernel VA
-      kernel_va = P2V(PTE_ADDR(*pte));
+  for (i = 0; i < MAX_MMAPS_PROC; i++)
+  {
+    np->vm->mmaps[i] = p->vm->mmaps[i];
+    if (!np->vm->mmaps[i].used)
+      continue;
+    np->vm->mmaps[i].dirty = 0;
+    if (np->vm->mmaps[i].file)
+      filedup(np->vm->mmaps[i].file);
+    num_system_mmap_areas++;
+  }
+  for (i = 0; i < p->vm->nholes; i++)
+    np->vm->holes[i] = p->vm->holes[i];
+  np->vm->nholes = p->vm->nholes;
+  np->vm->mmap_sp = p->vm->mmap_sp;
+  return 0;
+}
 
-      begin_op();
-      writei(ma->file->ip, kernel_va, ma->offset + stride, PGSIZE);
-      end_op();
+// Give p a copy of its own of the page at va if the frame is
+// copy-on-write shared (after fork() or by ksmd), so that writing
+// the frame through its kernel address can't reach other processes.
+// Returns -1 if out of memory.
+static int
+mmap_unshare(struct proc *p, uint va)
+{
+  pte_t *pte;
+  char *mem, *old;
+
+  acquire(&p->vm->ptlock);
+  pte = walkpgdir2(p->pgdir, (void*)va, 0);
+  if (pte == 0 || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW) ||
+      pageframe_counters[PTE_ADDR(*pte) / PGSIZE] <= 1)
+  {
+    release(&p->vm->ptlock);
+    return 0;
+  }
+  if ((mem = kalloc()) == 0)
+  {
+    release(&p->vm->ptlock);
+    return -1;
+  }
+  old = P2V(PTE_ADDR(*pte));
+  memmove(mem, old, PGSIZE);
+  kfree(old);
+  *pte = V2P(mem) | PTE_FLAGS(*pte); // Still PTE_COW: the first write just enables PTE_W
+  release(&p->vm->ptlock);
+  tlbflush(p);
+  return 0;
+}
+
+// Read the file contents for [from, to) of ma, whose pages are mapped.
+// Goes through kernel addresses, so PTE_D stays clear. A shared
+// frame would show the data to other processes too; see mmap_unshare().
+static void
+mmap_fill(struct proc *p, struct mmap_area *ma, uint from, uint to)
+{
+  struct inode *ip = ma->file->ip;
+  pte_t *pte;
+  char *kernel_va;
+  uint va, n;
+
+  for (va = from; va < to; va += n)
+  {
+    n = PGROUNDDOWN(va) + PGSIZE - va;
+    if (n > to - va)
+      n = to - va;
+    if ((pte = walkpgdir2(p->pgdir, (void*)va, 0)) == 0 || !(*pte & PTE_P))
+      continue;
+    kernel_va = (char*)P2V(PTE_ADDR(*pte)) + va % PGSIZE;
+    memset(kernel_va, 0, n); // Past the end of the file stays zero
+    ilock(ip);
+    readi(ip, kernel_va, ma->offset + (va - ma->addr), n);
+    iunlock(ip);
+  }
+}
+
+// Resize the mapping at old from oldlen to newlen bytes.
+// Shrinking unmaps the tail. Growing extends the mapping in place
+// if the range above it is free; otherwise, with MREMAP_MAYMOVE,
+// the mapping moves to a new range by moving its PTEs, so no page
+// is copied or written back. Returns the (new) address, or -1.
+int mremap(void* old, int oldlen, int newlen, int flags)
+{
+  struct proc *p = myproc();
+  uint addr = (uint)old, naddr, va;
+  struct mmap_area *ma;
+  pte_t *pte, *npte;
+  int i;
+
+  // 1. Handle error cases
+  if (addr % PGSIZE != 0 || oldlen <= 0 || newlen <= 0)
+    return -1;
+
+  // 2. Find mmap area
+  for (i = 0; i < MAX_MMAPS_PROC; i++) {
+    ma = &p->vm->mmaps[i];
+    if (ma->used && ma->addr == addr && ma->length == oldlen)
+      break;
+  }
+  if (i == MAX_MMAPS_PROC)
+    return -1;
+  if (newlen == oldlen)
+    return addr;
+
+  // 3. Shrink: write back the tail (including the bytes past newlen
+  //    in its last page), then free it.
+  if (newlen < oldlen)
+  {
+    if (ma->file && !(ma->flags & MAP_PRIVATE))
+    {
+      if (ma->dirty)
+        mmap_writeback(p, ma, PGROUNDDOWN(addr + newlen), addr + oldlen, 0);
+      wbwait(ma->file->ip);
     }
+    acquire(&p->vm->ptlock);
+    ma->length = newlen;
+    release(&p->vm->ptlock);
+    tlbunmap(p, addr + newlen, addr + oldlen);
+    if (PGROUNDUP(newlen) < PGROUNDUP(oldlen))
+      mmap_free_range(p, addr + PGROUNDUP(newlen), PGROUNDUP(oldlen) - PGROUNDUP(newlen));
+    return addr;
   }
-  lcr3(V2P(p->pgdir));
 
-  // 4. Deallocate and free pages
-  deallocuvm(p->pgdir, addr_uint + length, addr_uint);
-  lcr3(V2P(p->pgdir));  
+  // 4. Grow: in place if the range above is free, else move the PTEs.
+  //    mmap_fill() writes the rest of the last page, so that page must
+  //    be ours alone first.
+  if (ma->file && oldlen % PGSIZE != 0 && mmap_unshare(p, addr + PGROUNDDOWN(oldlen)) < 0)
+    return -1;
+  if (PGROUNDUP(newlen) == PGROUNDUP(oldlen) ||
+     mmap_take_range(p, addr + PGROUNDUP(oldlen), PGROUNDUP(newlen) - PGROUNDUP(oldlen)) == 0)
+  {
+    naddr = addr;
+  }
+  else
+  {
+    if (!(flags & MREMAP_MAYMOVE))
+      return -1;
+    if ((naddr = mmap_alloc_range(p, newlen)) == 0)
+      return -1;
 
-  // 5. Update values
-  num_system_mmap_areas--;
-  ma->used = 0;
+    // Allocate the page tables first, so the move itself can't fail.
+    for (va = 0; va < oldlen; va += PGSIZE)
+    {
+      if (walkpgdir2(p->pgdir, (void*)(naddr + va), 1) == 0)
+      {
+        mmap_free_range(p, naddr, newlen);
+        return -1;
+      }
+    }
+    // So are the new pages of a file mapping: on failure the mapping
+    // must still be at addr.
+    if (ma->file && allocuvm(p->pgdir, naddr + oldlen, naddr + newlen) == 0)
+    {
+      mmap_free_range(p, naddr, newlen);
+      return -1;
+    }
+    acquire(&p->vm->ptlock);
+    for (va = 0; va < oldlen; va += PGSIZE)
+    {
+      if ((pte = walkpgdir2(p->pgdir, (void*)(addr + va), 0)) == 0 || *pte == 0)
+        continue;
+      npte = walkpgdir2(p->pgdir, (void*)(naddr + va), 0);
+      *npte = *pte;
+      *pte = 0;
+    }
+    ma->addr = naddr;
+    release(&p->vm->ptlock);
+    tlbflush(p);
+    mmap_free_range(p, addr, oldlen);
+  }
+
+  // 5. Populate the new part. Anonymous pages are faulted in on demand.
+  if (ma->file)
+  {
+    if (naddr == addr && allocuvm(p->pgdir, naddr + oldlen, naddr + newlen) == 0)
+    {
+      // Can't extend; the mapping stays as it was.
+      if (PGROUNDUP(newlen) > PGROUNDUP(oldlen))
+        mmap_free_range(p, naddr + PGROUNDUP(oldlen), PGROUNDUP(newlen) - PGROUNDUP(oldlen));
+      mmap_update_sp(p);
+      return -1;
+    }
+    for (va = PGROUNDUP(naddr + oldlen); va < naddr + newlen; va += PGSIZE)
+      if ((pte = walkpgdir2(p->pgdir, (void*)va, 0)) != 0)
+        *pte &= ~PTE_W; // Read-only until the first write, as in mmap()
+    lcr3(V2P(p->pgdir));
+    mmap_fill(p, ma, naddr + oldlen, naddr + newlen);
+  }
+  ma->length = newlen;
+  mmap_update_sp(p);
+  return naddr;
+}
+
+int sys_mremap(void)
+{
+	int ptr, oldlen, newlen, flags, r;
+	if ( argint(0, &ptr) < 0 || argint(1, &oldlen) < 0 ||
+			argint(2, &newlen) < 0 || argint(3, &flags) < 0 )
+		return -1;
+	acquiresleep(&myproc()->vm->lock);
+	r = mremap((void*)ptr, oldlen, newlen, flags);
+	releasesleep(&myproc()->vm->lock);
+	return r;
+}
+
+// Change the access rights of the pages in [addr, addr + len) to prot
+// (MAP_PROT_NONE, MAP_PROT_READ or MAP_PROT_READ | MAP_PROT_WRITE).
+// The range may cover heap pages and parts of mappings. The
+// protection is kept per page in PTE_WP and PTE_U, so a page that
+// isn't mapped yet gets it when trap() maps it. A mapping can't be
+// made writable beyond what mmap() allowed.
+int mprotect(void* addr, int length, int prot)
+{
+  struct proc *p = myproc();
+  uint start = (uint)addr, end, va;
+  struct mmap_area *ma;
+  pte_t *pte;
+  int i, n;
+
+  // 1. Handle error cases
+  if (start % PGSIZE != 0 || length <= 0 || (prot & ~(MAP_PROT_READ | MAP_PROT_WRITE)))
+    return -1;
+  end = PGROUNDUP(start + length);
+  if (end < start || end > KERNBASE)
+    return -1;
+
+  // 2. Every page must be heap or inside a mapping that allows prot.
+  for (va = start; va < end; va += PGSIZE)
+  {
+    if (va < p->sz)
+      continue;
+    for (i = 0; i < MAX_MMAPS_PROC; i++)
+    {
+      ma = &p->vm->mmaps[i];
+      if (ma->used && va >= ma->addr && va < ma->addr + ma->length)
+        break;
+    }
+    if (i == MAX_MMAPS_PROC)
+      return -1;
+    if ((prot & MAP_PROT_WRITE) && !(ma->flags & MAP_PROT_WRITE))
+      return -1;
+  }
+
+  // 3. Update PTEs
+  n = 0;
+  acquire(&p->vm->ptlock);
+  for (va = start; va < end; va += PGSIZE)
+  {
+    if ((pte = walkpgdir2(p->pgdir, (void*)va, 1)) == 0)
+    {
+      release(&p->vm->ptlock);
+      tlbflush(p);
+      return -1;
+    }
+
+    if (!(*pte & PTE_P))
+    {
+      // Not mapped yet: only remember the protection.
+      if (prot & MAP_PROT_WRITE)
+        *pte = 0;
+      else if (prot & MAP_PROT_READ)
+        *pte = PTE_WP | PTE_U;
+      else
+        *pte = PTE_WP;
+      continue;
+    }
+
+    if (prot & MAP_PROT_WRITE)
+    {
+      *pte &= ~PTE_WP;
+      *pte |= PTE_U;
+
+      // Give write access back, except where trap() has to see the
+      // first write: copy-on-write pages and shared file mappings.
+      ma = 0;
+      for (i = 0; i < MAX_MMAPS_PROC; i++)
+        if (p->vm->mmaps[i].used && va >= p->vm->mmaps[i].addr && va < p->vm->mmaps[i].addr + p->vm->mmaps[i].length)
+          ma = &p->vm->mmaps[i];
+      if (!(*pte & PTE_COW) && !(ma && ma->file && !(ma->flags & MAP_PRIVATE)))
+        *pte |= PTE_W;
+    }
+    else
+    {
+      *pte |= PTE_WP;
+      *pte &= ~PTE_W;
+      if (prot & MAP_PROT_READ)
+        *pte |= PTE_U;
+      else
+        *pte &= ~PTE_U;
+    }
+    if (++n <= 32)
+      flushpage(va);
+  }
+  release(&p->vm->ptlock);
+
+  // 4. Invalidate the TLB. A few pages one by one, many all at once.
+  // Other CPUs running threads of p always flush everything.
+  if (n > 32)
+    tlbflush(p);
+  else
+    tlbshoot(p);
   return 0;
 }
 
-int sys_munmap(void)
+int sys_mprotect(void)
+{
+	int ptr, len, prot, r;
+	if ( argint(0, &ptr) < 0 || argint(1, &len) < 0 || argint(2, &prot) < 0 )
+		return -1;
+	acquiresleep(&myproc()->vm->lock);
+	r = mprotect((void*)ptr, len, prot);
+	releasesleep(&myproc()->vm->lock);
+	return r;
+}
+
+// Find the mapping of p that contains va, or 0.
+static struct mmap_area*
+mmap_find(struct proc *p, uint va)
+{
+  struct mmap_area *ma;
+
+  for (ma = p->vm->mmaps; ma < &p->vm->mmaps[MAX_MMAPS_PROC]; ma++)
+    if (ma->used && va >= ma->addr && va < ma->addr + ma->length)
+      return ma;
+  return 0;
+}
+
+// Lock (lock = 1) or unlock the pages in [addr, addr + len) in
+// memory. Missing pages of mappings are mapped first, so a locked
+// range never faults except for copy-on-write. Locked pages are
+// marked PTE_LOCK and counted in memstat(); anything that frees or
+// evicts pages must leave them alone. Locks are not inherited by
+// fork() and go away with the pages.
+static int
+mlock1(void* addr, int length, int lock)
+{
+  struct proc *p = myproc();
+  uint start = PGROUNDDOWN((uint)addr), end, va;
+  struct mmap_area *ma;
+  pte_t *pte;
+  int n;
+
+  // 1. Handle error cases
+  if (length <= 0)
+    return -1;
+  end = PGROUNDUP((uint)addr + length);
+  if (end < start || end > KERNBASE)
+    return -1;
+
+  // 2. Every page must be heap or mapped. Map missing ones.
+  for (va = start; va < end; va += PGSIZE)
+  {
+    if (va < p->sz)
+      continue;
+    if ((ma = mmap_find(p, va)) == 0)
+      return -1;
+    if (lock && ma->file == 0 && mmap_populate(p, ma, va, va + PGSIZE) < 0)
+      return -1;
+  }
+
+  // 3. Update PTEs. Only software bits change, so no TLB flush.
+  n = 0;
+  acquire(&p->vm->ptlock);
+  for (va = start; va < end; va += PGSIZE)
+  {
+    if ((pte = walkpgdir2(p->pgdir, (void*)va, 0)) == 0 || !(*pte & PTE_P))
+      continue;
+    if (lock && !(*pte & PTE_LOCK))
+    {
+      *pte |= PTE_LOCK;
+      n++;
+    }
+    else if (!lock && (*pte & PTE_LOCK))
+    {
+      *pte &= ~PTE_LOCK;
+      n--;
+    }
+  }
+  release(&p->vm->ptlock);
+  if (n)
+    kpin(n);
+  return 0;
+}
+
+int mlock(void* addr, int length)
+{
+  int r;
+
+  acquiresleep(&myproc()->vm->lock);
+  r = mlock1(addr, length, 1);
+  releasesleep(&myproc()->vm->lock);
+  return r;
+}
+
+int munlock(void* addr, int length)
+{
+  int r;
+
+  acquiresleep(&myproc()->vm->lock);
+  r = mlock1(addr, length, 0);
+  releasesleep(&myproc()->vm->lock);
+  return r;
+}
+
+int sys_mlock(void)
 {
 	int ptr, len;
+	if ( argint(0, &ptr) < 0 || argint(1, &len) < 0 )
+		return -1;
+	return mlock((void*)ptr, len);
+}
+
+int sys_munlock(void)
+{
+	int ptr, len;
+	if ( argint(0, &ptr) < 0 || argint(1, &len) < 0 )
+		return -1;
+	return munlock((void*)ptr, len);
+}
+
+int sys_munmap(void)
+{
+	int ptr, len, r;
 	if ( argint(0, &ptr) < 0 || argint(1, &len) < 0)
 		return -1;
-	return munmap((void*)ptr, len);
+	acquiresleep(&myproc()->vm->lock);
+	r = munmap((void*)ptr, len);
+	releasesleep(&myproc()->vm->lock);
+	return r;
+}
+
+// Write the dirty pages of a mapping back to its file without unmapping it.
+// The pages become write-protected again, so later writes are tracked.
+// With MS_ASYNC the pages are queued for the flusher thread instead.
+int msync(void* addr, int length, int flags)
+{
+  struct proc *p = myproc();
+  uint addr_uint = (uint)addr;
+  struct mmap_area *ma;
+  int i;
+
+  // 1. Handle error cases
+  if (addr_uint % PGSIZE != 0 || length <= 0)
+    return -1;
+  if (!(flags & (MS_SYNC | MS_ASYNC)) || ((flags & MS_SYNC) && (flags & MS_ASYNC)))
+    return -1;
+
+  // 2. Find mmap area containing the range
+  for (i = 0; i < MAX_MMAPS_PROC; i++) {
+    ma = &p->vm->mmaps[i];
+    if (ma->used && addr_uint >= ma->addr && addr_uint + length <= ma->addr + ma->length)
+      break;
+  }
+  if (i == MAX_MMAPS_PROC)
+    return -1;
+
+  // Anonymous, shm, ring and private mappings have nothing to write back.
+  if (!ma->file || (ma->flags & MAP_PRIVATE))
+    return 0;
+
+  // 3. Write back (or queue) the dirty pages
+  if (ma->dirty)
+  {
+    mmap_writeback(p, ma, addr_uint, addr_uint + length, flags & MS_ASYNC);
+    if (addr_uint == ma->addr && length == ma->length)
+      ma->dirty = 0;
+  }
+
+  // 4. MS_SYNC also waits for pages queued by earlier MS_ASYNC calls
+  if (flags & MS_SYNC)
+    wbwait(ma->file->ip);
+  return 0;
+}
+
+int sys_msync(void)
+{
+	int ptr, len, flags, r;
+	if ( argint(0, &ptr) < 0 || argint(1, &len) < 0 || argint(2, &flags) < 0)
+		return -1;
+	acquiresleep(&myproc()->vm->lock);
+	r = msync((void*)ptr, len, flags);
+	releasesleep(&myproc()->vm->lock);
+	return r;
 }
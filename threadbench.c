@@ -0,0 +1,57 @@
+// Run a fixed amount of work split among 1 to NTHREAD threads made
+// with clone(). The threads share the address space, so each one
+// writes its partial result straight into sum[]. With enough CPUS
+// the time should drop as threads are added.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NTHREAD   4
+#define WORK      (1 << 26)   // loop iterations in total
+#define STACKSZ   4096
+
+static volatile uint sum[NTHREAD];
+static int nthread;
+
+static void
+worker(void *arg)
+{
+  int id = (int)arg;
+  uint i, x = id + 1, s = 0;
+
+  for(i = 0; i < WORK / nthread; i++){
+    x = x * 1103515245 + 12345;
+    s += x >> 16;
+  }
+  sum[id] = s;
+  exit();
+}
+
+int
+main(void)
+{
+  char *stack[NTHREAD];
+  int i, t0;
+
+  for(i = 0; i < NTHREAD; i++){
+    if((stack[i] = malloc(STACKSZ)) == 0){
+      printf(1, "threadbench: malloc failed\n");
+      exit();
+    }
+  }
+
+  for(nthread = 1; nthread <= NTHREAD; nthread++){
+    t0 = uptime();
+    for(i = 0; i < nthread; i++){
+      if(clone(worker, stack[i] + STACKSZ, (void*)i) < 0){
+        printf(1, "threadbench: clone failed\n");
+        exit();
+      }
+    }
+    for(i = 0; i < nthread; i++)
+      wait();
+    printf(1, "%d threads: %d ticks\n", nthread, uptime() - t0);
+  }
+  exit();
+}
@@ -0,0 +1,174 @@
+//
+// TLB shootdown.
+//
+// Threads of a process share its page table and may run on several
+// CPUs at once. After a PTE loses rights or changes frame, every
+// CPU that might cache the old entry must flush its TLB before the
+// change can be relied on. tlbflush() asks the other CPUs with an
+// IPI and waits until each one has reloaded %cr3.
+//
+// Only CPUs that have the page table loaded can cache its entries,
+// since switching to another one flushes them. switchuvm() sets the
+// CPU's bit in vm->cpus and scheduler() clears it, so IPIs go to
+// those CPUs only. Operations that unmap many pages gather the
+// frames, shoot down once per NGATHER pages, and free the frames
+// only then (tlbunmap()).
+//
+// A CPU waiting for a flush (or for its turn to start one) keeps
+// serving requests aimed at itself, so two CPUs shooting at each
+// other can't deadlock even with interrupts off. A CPU spinning on
+// a spinlock can't serve requests, though, so tlbflush() must not
+// be called while holding one. A copy-on-write fault in kernel code
+// that holds one flushes only the local TLB and leaves the rest to
+// tlbdrain() at the end of the system call.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "traps.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
+
+// Local APIC registers, divided by 4 for use as uint[] indices.
+#define ID      (0x0020/4)   // ID
+#define ICRLO   (0x0300/4)   // Interrupt Command
+#define DELIVS  0x00001000   // Delivery status
+#define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
+
+static uint tlbbusy;   // A CPU is shooting down
+
+// Send interrupt vector to the CPU with APIC ID apicid.
+void
+lapicipi(int apicid, int vector)
+{
+  lapic[ICRHI] = apicid << 24;
+  lapic[ID];  // wait for write to finish, by reading
+  lapic[ICRLO] = vector;
+  lapic[ID];
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
+static void
+reloadcr3(void)
+{
+  uint val;
+
+  asm volatile("movl %%cr3,%0" : "=r" (val));
+  lcr3(val);
+}
+
+// Serve a flush request aimed at this CPU, if any.
+// Interrupts must be off.
+static void
+tlbpoll(void)
+{
+  struct cpu *c = mycpu();
+
+  if(c->tlbreq){
+    reloadcr3();
+    c->tlbreq = 0;
+  }
+}
+
+// Flush the TLB entries of p's address space on every CPU but
+// this one that has it loaded. Must not be called while holding a
+// spinlock.
+void
+tlbshoot(struct proc *p)
+{
+  struct cpu *c, *me;
+  uint mask;
+
+  pushcli();
+  me = mycpu();
+  // The PTE stores must be visible before vm->cpus is read: a CPU
+  // that sets its bit after this loads the new entries anyway.
+  __sync_synchronize();
+  mask = p->vm->cpus & ~(1 << (me - cpus));
+  if(mask == 0){
+    popcli();
+    return;
+  }
+
+  while(xchg(&tlbbusy, 1) != 0)
+    tlbpoll();
+  for(c = cpus; c < cpus+ncpu; c++){
+    if(!(mask & (1 << (c - cpus))) || !c->started)
+      continue;
+    c->tlbreq = 1;
+    lapicipi(c->apicid, T_TLBFLUSH);
+  }
+  for(c = cpus; c < cpus+ncpu; c++)
+    while((mask & (1 << (c - cpus))) && c->tlbreq)
+      tlbpoll();
+  xchg(&tlbbusy, 0);
+  popcli();
+}
+
+// Flush the TLB entries of p's address space on this CPU, if it
+// is p's, and on every other CPU that has it loaded.
+// Must not be called while holding a spinlock.
+void
+tlbflush(struct proc *p)
+{
+  if(p == myproc())
+    lcr3(V2P(p->pgdir));
+  tlbshoot(p);
+}
+
+// Unmap and free the pages of p in [start, end). Frames are freed
+// only after the TLBs are flushed, NGATHER at a time.
+// Takes p->vm->ptlock, so trap() can't map pages in between.
+void
+tlbunmap(struct proc *p, uint start, uint end)
+{
+  struct tlbgather tg;
+  uint va;
+  int i;
+
+  for(va = start; va < end; ){
+    tg.n = 0;
+    acquire(&p->vm->ptlock);
+    va = gatheruvm(&tg, p->pgdir, end, va);
+    release(&p->vm->ptlock);
+    tlbflush(p);
+    for(i = 0; i < tg.n; i++)
+      kfree(tg.pages[i]);
+  }
+}
+
+// Finish the shootdowns that copy-on-write faults taken under a
+// spinlock put off (see trap()), and free the frames they replaced.
+// Until then other CPUs may still read through the old entries.
+// Must not be called while holding a spinlock.
+void
+tlbdrain(struct proc *p)
+{
+  struct tlbgather tg;
+  int i;
+
+  if(p->vm->cowdefer.n == 0)
+    return;
+  acquire(&p->vm->ptlock);
+  tg = p->vm->cowdefer;
+  p->vm->cowdefer.n = 0;
+  release(&p->vm->ptlock);
+  tlbshoot(p);
+  for(i = 0; i < tg.n; i++)
+    kfree(tg.pages[i]);
+}
+
+// T_TLBFLUSH interrupt.
+void
+tlbintr(void)
+{
+  tlbpoll();
+  lapiceoi();
+}
@@ -0,0 +1,95 @@
+// Show what the CPUs and processes are doing: "top [n]" prints n
+// (default 5) reports, one per second. %CPU is the share of clock
+// ticks of one CPU that the process ran for since the last report;
+// it is "-" for processes that weren't in that report.
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "param.h"
+#include "schedstat.h"
+
+#define INTERVAL 100   // ticks between reports
+
+static char *states[] = {
+  "unused", "embryo", "sleep ", "runble", "run   ", "zombie"
+};
+
+// NPROC may be large, and the stack is one page: keep these static.
+static struct cpustat cpus[NCPU], lastcpus[NCPU];
+static int lastpid[NPROC], curpid[NPROC];
+static uint lastticks[NPROC], curticks[NPROC];
+static int nlast;
+
+// Ticks that pid had run for at the last report, or -1.
+static int
+before(int pid)
+{
+  int i;
+
+  for(i = 0; i < nlast; i++)
+    if(lastpid[i] == pid)
+      return lastticks[i];
+  return -1;
+}
+
+static void
+report(int elapsed)
+{
+  struct procstat ps;
+  int i, n, ncpu, busy, idle, t0;
+
+  ncpu = getcpustats(cpus, NCPU);
+  if(ncpu > NCPU)
+    ncpu = NCPU;
+  printf(1, "cpu  idle%%  switches  halts  wakeups\n");
+  for(i = 0; i < ncpu; i++){
+    busy = cpus[i].busyticks - lastcpus[i].busyticks;
+    idle = cpus[i].idleticks - lastcpus[i].idleticks;
+    printf(1, "%d    %d      %d  %d  %d\n", i,
+           idle * 100 / (busy + idle + 1),
+           cpus[i].switches - lastcpus[i].switches,
+           cpus[i].halts - lastcpus[i].halts,
+           cpus[i].wakeups - lastcpus[i].wakeups);
+    lastcpus[i] = cpus[i];
+  }
+
+  printf(1, "pid  state  cpu  %%cpu  ticks  wait  vcsw  ivcsw  "
+         "mig  cow  mmap  zero  syscalls  name\n");
+  n = 0;
+  for(ps.pid = 1; n < NPROC && getprocstats(ps.pid, &ps) >= 0; ps.pid++){
+    printf(1, "%d  %s  %d  ", ps.pid, ps.state < 6 ? states[ps.state] : "???", ps.cpu);
+    if((t0 = before(ps.pid)) >= 0)
+      printf(1, "%d", (ps.cputicks - t0) * 100 / (elapsed + 1));
+    else
+      printf(1, "-");
+    printf(1, "  %d  %d  %d  %d  %d  %d  %d  %d  %d  %s\n",
+           ps.cputicks, ps.waitticks, ps.vcsw, ps.ivcsw, ps.migrations,
+           ps.cowfaults, ps.mmapfaults, ps.zerofaults, ps.syscalls, ps.name);
+    curpid[n] = ps.pid;
+    curticks[n] = ps.cputicks;
+    n++;
+  }
+  for(i = 0; i < n; i++){
+    lastpid[i] = curpid[i];
+    lastticks[i] = curticks[i];
+  }
+  nlast = n;
+  printf(1, "\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, t0, t1;
+
+  n = argc > 1 ? atoi(argv[1]) : 5;
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    sleep(INTERVAL);
+    t1 = uptime();
+    report(t1 - t0);
+    t0 = t1;
+  }
+  exit();
+}
@@ -7,9 +7,12 @@
 #include "x86.h"
 #include "traps.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
 
 #define MAP_PROT_READ  0x00000001
 #define MAP_PROT_WRITE 0x00000002
+#define MAP_PRIVATE    0x00000010
 
 // Interrupt descriptor table (shared by all CPUs).
 struct gatedesc idt[256];
@@ -45,6 +48,7 @@ trap(struct trapframe *tf)
       exit();
     myproc()->tf = tf;
     syscall();
+    tlbdrain(myproc());
     if(myproc()->killed)
       exit();
     return;
@@ -58,6 +62,12 @@ trap(struct trapframe *tf)
       wakeup(&ticks);
       release(&tickslock);
     }
+    clocktick();
+    if(myproc()){
+      mycpu()->busyticks++;
+      myproc()->cputicks++;
+    } else
+      mycpu()->idleticks++;
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -85,6 +95,13 @@ trap(struct trapframe *tf)
             cpuid(), tf->cs, tf->eip);
     lapiceoi();
     break;
+  case T_TLBFLUSH:
+    tlbintr();
+    break;
+  case T_WAKEUP:
+    mycpu()->wakeups++;  // scheduler() looks at its queues again
+    lapiceoi();
+    break;
   case T_PGFLT: 
   {
     // If page fault happens, this code will run
@@ -92,11 +109,30 @@ trap(struct trapframe *tf)
     uint va = rcr2(); // Address which caused the page fault is stored in cr2. User rcr2() to get it.
     va = PGROUNDDOWN(va); // PTEs only store multiples of pagesizes. Use PGROUNDDOWN to round down.
     struct proc *p = myproc(); 
+    struct vmspace *vm = p->vm;
+    int locked = mycpu()->ncli > 0; // the faulting kernel code holds a spinlock
+    acquire(&vm->ptlock); // Threads may fault on the same page at once
     pte_t *pte = walkpgdir2(p->pgdir, (void*)va, 0); // get pte from va
 
+    // Another thread has already handled a fault on this page,
+    // and this CPU's TLB still holds the old entry.
+    if(pte && (*pte & (PTE_P | PTE_U)) == (PTE_P | PTE_U) && (!(tf->err & 2) || (*pte & PTE_W))){
+      release(&vm->ptlock);
+      flushpage(va);
+      return;
+    }
+
+    // Case 0: mprotect(). A present PTE_WP page only faults on a forbidden access.
+    // A missing page keeps its protection in the PTE until trap() maps it (Case 2).
+    if(pte && (*pte & PTE_WP)){
+      if((*pte & PTE_P) || !(*pte & PTE_U) || (tf->err & 2))
+        goto bad;
+    }
+
     // Case 1: CoW
     if(pte && (*pte & PTE_P) && !(*pte & PTE_W) && (*pte & PTE_COW)){
       // check if present, currently non-writable, and is marked CoW
+      p->cowfaults++;
       uint pa = PTE_ADDR(*pte); // get physical address from pte
       int i = pa/PGSIZE; // get index of pa in pageframe_counters array
       
@@ -106,10 +142,22 @@ trap(struct trapframe *tf)
         if(newpa == 0)
           panic("CoW: kalloc failed");
         memmove(newpa, (char*)P2V(pa), PGSIZE); // copy contents from parent pageframe to the free pageframe
-        pageframe_counters[i]--;
-        *pte = (V2P(newpa) | PTE_P | PTE_W | PTE_U) & ~PTE_COW; // this is code from the original copyuvm() function
+        *pte = (V2P(newpa) | PTE_P | PTE_W | PTE_U | (*pte & PTE_LOCK)) & ~PTE_COW; // this is code from the original copyuvm() function
                                                                 // set to present, writable, and user, then remove cow
-        lcr3(V2P(p->pgdir)); // flush TLB (reset/update TLB)
+                                                                // An mlock()ed page stays locked
+        // A thread spinning for the lock the faulting code holds (e.g. pipe->lock
+        // during a copy to a user buffer) would never answer a shootdown. Flush
+        // here only; tlbdrain() shoots down and drops the old frame after the
+        // system call. If too many are pending, flush now as usual.
+        if(locked && vm->cowdefer.n < NGATHER){
+          vm->cowdefer.pages[vm->cowdefer.n++] = P2V(pa);
+          release(&vm->ptlock);
+          flushpage(va);
+          return;
+        }
+        kfree(P2V(pa)); // drop our reference. ksmd changes counters too, so do it under kmem.lock
+        release(&vm->ptlock);
+        tlbflush(p); // flush TLB (reset/update TLB), also where other threads run
         return;
       }
       else // Counter is 1. Process is the sole owner of the page (eg. child is dead, so parent is the only one
@@ -117,22 +165,22 @@ trap(struct trapframe *tf)
       {
         *pte |= PTE_W;       // Enable write
         *pte &= ~PTE_COW;    // Remove CoW bit
-        lcr3(V2P(p->pgdir)); // flush TLB (reset/update TLB)
+        release(&vm->ptlock);
+        lcr3(V2P(p->pgdir)); // flush TLB (reset/update TLB). Other threads just fault once more
         return;
       }
     }
 
 
     // Case 2: mmap area
-    // Find mmap area
+    // Find the mmap area containing va
     struct mmap_area *ma;
     int i = 0;
     while (i < MAX_MMAPS_PROC)
     {
-      if (va == p->mmaps[i].addr){
-        ma = &p->mmaps[i];
+      ma = &p->vm->mmaps[i];
+      if (ma->used && va >= ma->addr && va < ma->addr + ma->length)
         break;
-      }
 
       i++;
     }
@@ -140,13 +188,63 @@ trap(struct trapframe *tf)
     if (i == MAX_MMAPS_PROC) // Not found mmap area, invalid access
       goto bad;
 
-    // If writable
-    if (ma->flags & MAP_PROT_WRITE)
+    // Anonymous mapping touched for the first time: map a zeroed page.
+    if (ma->file == 0 && (pte == 0 || !(*pte & PTE_P)))
     {
-      pte = walkpgdir2(p->pgdir, (char*)va, 0);
+      p->zerofaults++;
+      char *mem = kalloc();
+      if (mem == 0)
+      {
+        cprintf("demand-zero: out of memory\n");
+        goto bad;
+      }
+      memset(mem, 0, PGSIZE);
+      if ((pte = walkpgdir2(p->pgdir, (char*)va, 1)) == 0)
+      {
+        kfree(mem);
+        goto bad;
+      }
+      if (*pte & PTE_WP) // Made read-only by mprotect() before it was touched
+        *pte = V2P(mem) | PTE_P | PTE_U | PTE_WP;
+      else
+      {
+        *pte = V2P(mem) | PTE_P | PTE_U;
+        if (ma->flags & MAP_PROT_WRITE)
+          *pte |= PTE_W;
+      }
+      release(&vm->ptlock);
+      return; // Entry was not present, so there's nothing to flush from the TLB
+    }
+
+    if (pte == 0 || !(*pte & PTE_P) || ma->file == 0) // e.g. write to a read-only anonymous page
+      goto bad;
+
+    p->mmapfaults++;
+
+    // If writable, grant write on this page only and mark it dirty.
+    // The MMU would set PTE_D on the store anyway; setting it here
+    // keeps munmap() correct even if the store never retires.
+    if ((ma->flags & MAP_PROT_WRITE) && (ma->flags & MAP_PRIVATE))
+    {
+      // Private mapping: writes never reach the file, so no dirty tracking.
       *pte |= PTE_W;
-      lcr3(V2P(p->pgdir));     
+      release(&vm->ptlock);
+      lcr3(V2P(p->pgdir));
+      return;
+    }
+    if (ma->flags & MAP_PROT_WRITE)
+    {
+      // A page that mprotect() made read-only and back keeps PTE_D
+      // and is already counted as dirty.
+      int newdirty = !(*pte & PTE_D);
+      *pte |= PTE_W | PTE_D;
+      if (!ma->dirty)
+        ma->dirtytick = ticks;
       ma->dirty = 1;
+      release(&vm->ptlock);
+      lcr3(V2P(p->pgdir));     
+      if (newdirty)
+        wbdirty(); // Might wait for the syncer if too many pages are dirty
       return;
     }
     
@@ -160,6 +258,7 @@ trap(struct trapframe *tf)
         cprintf("PTE=*0x%x\n", *pte);
       else
         cprintf("no PTE!\n");
+      release(&vm->ptlock);
       p->killed = 1;
       break;
   }
@@ -187,11 +286,12 @@ trap(struct trapframe *tf)
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
 
-  // Force process to give up CPU on clock tick.
+  // Force process to give up CPU when its timeslice is over
+  // or a higher-priority process is waiting (see schedtick).
   // If interrupts were on while locks held, would need to check nlock.
   if(myproc() && myproc()->state == RUNNING &&
-     tf->trapno == T_IRQ0+IRQ_TIMER)
-    yield();
+     tf->trapno == T_IRQ0+IRQ_TIMER && schedtick())
+    preempt();
 
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
@@ -5,7 +5,11 @@
 #include "memlayout.h"
 #include "mmu.h"
 #include "proc.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
 #include "elf.h"
+#include "clock.h"
 
 #include "memlayout.h"
 
@@ -120,6 +124,7 @@ mappages(pde_t *pgdir, void *va, uint size, uint pa, int perm)
 //                for the kernel's instructions and r/o data
 //   data..KERNBASE+PHYSTOP: mapped to V2P(data)..PHYSTOP,
 //                                  rw data + free physical memory
+//   CLOCKVA: clockpage, readable by user code (see clock.c)
 //   0xfe000000..0: mapped direct (devices such as ioapic)
 //
 // The kernel allocates physical memory for its heap and for user memory
@@ -138,6 +143,7 @@ static struct kmap {
  { (void*)KERNLINK, V2P(KERNLINK), V2P(data), 0},     // kern text+rodata
  { (void*)data,     V2P(data),     PHYSTOP,   PTE_W}, // kern data+memory
  { (void*)DEVSPACE, DEVSPACE,      0,         PTE_W}, // more devices
+ { (void*)CLOCKVA,  V2P(clockpage), V2P(clockpage) + PGSIZE, PTE_U}, // clock, read-only
 };
 
 // Set up kernel part of a page table.
@@ -199,6 +205,7 @@ switchuvm(struct proc *p)
   // forbids I/O instructions (e.g., inb and outb) from user space
   mycpu()->ts.iomb = (ushort) 0xFFFF;
   ltr(SEG_TSS << 3);
+  __sync_fetch_and_or(&p->vm->cpus, 1 << cpuid()); // before loading, see tlbshoot()
   lcr3(V2P(p->pgdir));  // switch to process's address space
   popcli();
 }
@@ -274,18 +281,15 @@ allocuvm(pde_t *pgdir, uint oldsz, uint newsz)
   return newsz;
 }
 
-// Deallocate user pages to bring the process size from oldsz to
-// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
-// need to be less than oldsz.  oldsz can be larger than the actual
-// process size.  Returns the new process size.
-int
-deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+// Unmap user pages from newsz up to oldsz. Free them, or if tg is
+// not 0, add them to tg instead and stop once it is full.
+// Returns the address reached, oldsz or more when done.
+static uint
+unmapuvm(pde_t *pgdir, uint oldsz, uint newsz, struct tlbgather *tg)
 {
   pte_t *pte;
   uint a, pa;
-
-  if(newsz >= oldsz)
-    return oldsz;
+  int unlocked = 0;
 
   a = PGROUNDUP(newsz);
   for(; a  < oldsz; a += PGSIZE){
@@ -293,17 +297,48 @@ deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
     if(!pte)
       a = PGADDR(PDX(a) + 1, 0, 0) - PGSIZE;
     else if((*pte & PTE_P) != 0){
+      if(tg && tg->n == NGATHER)
+        break;
       pa = PTE_ADDR(*pte);
       if(pa == 0)
         panic("kfree");
+      if(*pte & PTE_LOCK)
+        unlocked++;
       char *v = P2V(pa);
-      kfree(v);
+      if(tg)
+        tg->pages[tg->n++] = v;
+      else
+        kfree(v);
       *pte = 0;
-    }
+    } else
+      *pte = 0;  // May hold an mprotect() protection
   }
+  if(unlocked)
+    kpin(-unlocked);
+  return a;
+}
+
+// Deallocate user pages to bring the process size from oldsz to
+// newsz.  oldsz and newsz need not be page-aligned, nor does newsz
+// need to be less than oldsz.  oldsz can be larger than the actual
+// process size.  Returns the new process size.
+int
+deallocuvm(pde_t *pgdir, uint oldsz, uint newsz)
+{
+  if(newsz >= oldsz)
+    return oldsz;
+  unmapuvm(pgdir, oldsz, newsz, 0);
   return newsz;
 }
 
+// Unmap pages like deallocuvm(), but leave freeing them to
+// the caller through tg (see tlbunmap()).
+uint
+gatheruvm(struct tlbgather *tg, pde_t *pgdir, uint oldsz, uint newsz)
+{
+  return unmapuvm(pgdir, oldsz, newsz, tg);
+}
+
 // Free a page table and all the physical memory pages
 // in the user part.
 void
@@ -359,23 +394,31 @@ copyuvm(pde_t *pgdir, uint sz)
     *pte &= ~PTE_W;  // remove write bit. If try to write, it will trap, then will start Copy-on-Write
     *pte |= PTE_COW; // Turn on CoW bit.
 
-    int index = pa/PGSIZE;       // get index for page frame counter array
-    pageframe_counters[index]++; // increment counter
+    kdup(P2V(pa));               // increment counter
 
-    flags = PTE_FLAGS(*pte);
+    flags = PTE_FLAGS(*pte) & ~PTE_LOCK; // mlock() is not inherited
     if(mappages(d, (void*)i, PGSIZE, pa, flags) < 0) {
       goto bad;
     }
 
   }
-  lcr3(V2P(myproc()->pgdir)); // flush/reset/update TLB
-  return d;
+  return d; // fork() flushes the parent's TLBs, also where its threads run
+
 
 bad:
   freevm(d);
   return 0;
 }
 
+// Drop this CPU's TLB entry for user address va. Cheaper than
+// reloading %cr3 when only a few pages of the current process
+// changed.
+void
+flushpage(uint va)
+{
+  asm volatile("invlpg (%0)" : : "r" (va) : "memory");
+}
+
 //PAGEBREAK!
 // Map user virtual address to kernel address.
 char*
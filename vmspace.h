@@ -0,0 +1,26 @@
+#define NGATHER 32
+
+// Frames unmapped by one operation. They are freed only after every
+// CPU that may cache their old PTEs has flushed its TLB, so that no
+// thread can reach a frame once it is reused (see tlbunmap()).
+struct tlbgather {
+  int n;
+  char *pages[NGATHER];
+};
+
+// User address space state shared by the threads of a process.
+// Every proc points to one. clone() shares it, fork() copies it.
+// The threads also share pgdir and keep equal copies of sz, which
+// growproc() updates in all of them.
+struct vmspace {
+  struct sleeplock lock;       // Serializes mmap(), munmap(), growproc() etc.
+  struct spinlock ptlock;      // Held while a page fault changes the page table; protects ref and users
+  int ref;                     // Procs that point here, zombies included
+  int users;                   // Procs that haven't exited yet
+  volatile uint cpus;          // Bit i set while cpus[i] has the page table loaded
+  struct mmap_area mmaps[MAX_MMAPS_PROC];
+  uint mmap_sp;                // Lowest mapped address. Starts from KERNBASE - PGSIZE; the heap must stay below it
+  struct mmap_hole holes[MAX_MMAP_HOLES]; // Free ranges below KERNBASE - PGSIZE, in address order
+  int nholes;                  // Number of entries in holes[]
+  struct tlbgather cowdefer;   // Frames replaced by CoW faults under a spinlock; see tlbdrain()
+};
@@ -0,0 +1,402 @@
+//
+// Writeback of dirty file-backed mmap pages.
+//
+// munmap() and msync(MS_SYNC) write dirty pages themselves.
+// msync(MS_ASYNC) only queues them for the flusher kernel
+// thread. The syncer kernel thread periodically queues pages
+// of mappings that have been dirty for a while, and throttles
+// writers when too many pages are dirty. A queued page holds
+// a reference on its frame and on the inode, so it stays valid
+// even if the mapping is torn down before the flusher gets to it.
+//
+// The buffer cache needs none of this: log commits at end_op()
+// already write every modified block.
+//
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "mmu.h"
+#include "proc.h"
+#include "x86.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "vmspace.h"
+#include "fs.h"
+#include "file.h"
+
+#define NWBQ       64   // maximum number of queued pages
+#define WBBATCH    16   // pages the syncer queues per round
+#define WBPERIOD   100  // ticks between syncer rounds
+#define WBAGE      300  // ticks a mapping may stay dirty
+#define WBBGDIRTY  128  // dirty pages above which age is ignored
+#define WBMAXDIRTY 256  // dirty pages above which writers are throttled
+#define WBTHROTTLE 10   // maximum ticks a writer is throttled
+
+// Marks a slot taken by the syncer but not yet filled.
+#define WBRESERVED ((struct inode*)-1)
+
+struct wbreq {
+  struct inode *ip;  // File to write to; 0 if slot is free
+  uint off;          // Offset in file
+  int n;             // Number of bytes
+  char *page;        // Kernel address of the page frame
+  int busy;          // Being written by the flusher
+};
+
+struct {
+  struct spinlock lock;
+  struct wbreq q[NWBQ];
+  int n;             // Number of used or reserved slots
+  int ready;         // Number of slots waiting for the flusher
+  int ndirty;        // Dirty file-backed mmap pages in the system
+} wbq;
+
+static int wbkick;   // Writers want a syncer round now
+
+// An open log transaction that pages of one inode are written
+// into. It is ended when it holds as many bytes as filewrite()
+// puts in one transaction, or when a page of another inode comes.
+struct wbctx {
+  struct inode *ip;  // Locked inode of the open transaction, or 0
+  int used;          // Bytes written in the open transaction
+};
+
+static void
+wbend(struct wbctx *c)
+{
+  if(c->ip){
+    iunlock(c->ip);
+    end_op();
+    c->ip = 0;
+  }
+}
+
+static void
+wbput(struct wbctx *c, struct inode *ip, char *src, uint off, int n)
+{
+  int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+  int n1;
+
+  if(c->ip && c->ip != ip)
+    wbend(c);
+  while(n > 0){
+    if(c->ip == 0){
+      begin_op();
+      ilock(ip);
+      c->ip = ip;
+      c->used = 0;
+    }
+    n1 = n;
+    if(n1 > max - c->used)
+      n1 = max - c->used;
+    writei(ip, src, off, n1);
+    c->used += n1;
+    src += n1;
+    off += n1;
+    n -= n1;
+    if(c->used == max)
+      wbend(c);
+  }
+}
+
+// Hand a page to the flusher. Sleeps while the queue is full.
+static void
+wbqueue(struct inode *ip, char *page, uint off, int n)
+{
+  struct wbreq *r;
+
+  acquire(&wbq.lock);
+  while(wbq.n == NWBQ)
+    sleep(wbq.q, &wbq.lock);
+  for(r = wbq.q; r < &wbq.q[NWBQ]; r++)
+    if(r->ip == 0)
+      break;
+  r->ip = idup(ip);
+  r->page = page;
+  kdup(page);
+  r->off = off;
+  r->n = n;
+  r->busy = 0;
+  wbq.n++;
+  wbq.ready++;
+  wakeup(&wbq);
+  release(&wbq.lock);
+}
+
+// Count a page that trap() is about to make writable. If too many
+// pages are dirty, kick the syncer and wait a few ticks for it.
+// Faults taken while the kernel holds a spinlock (e.g. piperead()
+// copying into a mapping) are counted but not throttled.
+void
+wbdirty(void)
+{
+  uint t0;
+
+  acquire(&wbq.lock);
+  wbq.ndirty++;
+  t0 = ticks;
+  while(wbq.ndirty > WBMAXDIRTY && ticks - t0 < WBTHROTTLE &&
+        mycpu()->ncli == 1 && !myproc()->killed){
+    wbkick = 1;
+    sleep(&wbq.ndirty, &wbq.lock);
+  }
+  release(&wbq.lock);
+}
+
+// n dirty pages have been cleaned.
+static void
+wbclean(int n)
+{
+  acquire(&wbq.lock);
+  wbq.ndirty -= n;
+  if(wbq.ndirty < 0)
+    wbq.ndirty = 0;
+  wakeup(&wbq.ndirty);
+  release(&wbq.lock);
+}
+
+// Write the dirty pages of ma in [start, end) back to its file, and
+// write-protect them again so trap() sees the next store.
+// A page is dirty if its PTE_D bit is set. Clean pages are skipped.
+// If async, the pages are queued for the flusher instead of written.
+// Pages are handled WBBATCH at a time: write-protect them, flush
+// the TLBs, then copy. A thread on another CPU may store into a
+// page until its TLB is flushed, so copying earlier could miss it.
+void
+mmap_writeback(struct proc *p, struct mmap_area *ma, uint start, uint end, int async)
+{
+  struct inode *ip = ma->file->ip;
+  struct wbctx c;
+  uint va, off, batch[WBBATCH];
+  pte_t *pte;
+  char *kernel_va;
+  int i, n, nbatch, cleaned = 0;
+
+  c.ip = 0;
+  for(va = start; va < end; ){
+    // Write-protect up to WBBATCH dirty pages.
+    nbatch = 0;
+    acquire(&p->vm->ptlock);
+    for(; va < end && nbatch < WBBATCH; va += PGSIZE){
+      if((pte = walkpgdir2(p->pgdir, (void*)va, 0)) == 0)
+        continue;
+      if(!(*pte & PTE_P) || !(*pte & PTE_D))
+        continue;
+      *pte &= ~(PTE_W | PTE_D);
+      batch[nbatch++] = va;
+    }
+    release(&p->vm->ptlock);
+    if(nbatch == 0)
+      break;
+    tlbflush(p);
+
+    for(i = 0; i < nbatch; i++){
+      // Don't write past the end of the mapping.
+      n = ma->addr + ma->length - batch[i];
+      if(n > PGSIZE)
+        n = PGSIZE;
+      off = ma->offset + (batch[i] - ma->addr);
+
+      // Convert to kernel VA. The page stays mapped: the caller
+      // holds p->vm->lock, so munmap() can't run meanwhile.
+      pte = walkpgdir2(p->pgdir, (void*)batch[i], 0);
+      kernel_va = P2V(PTE_ADDR(*pte));
+      cleaned++;
+      if(async)
+        wbqueue(ip, kernel_va, off, n);
+      else
+        wbput(&c, ip, kernel_va, off, n);
+    }
+  }
+  wbend(&c);
+  if(cleaned)
+    wbclean(cleaned);
+}
+
+// Wait until no queued page of ip is left.
+void
+wbwait(struct inode *ip)
+{
+  struct wbreq *r;
+
+  acquire(&wbq.lock);
+  for(;;){
+    for(r = wbq.q; r < &wbq.q[NWBQ]; r++)
+      if(r->ip == ip || r->ip == WBRESERVED)
+        break;
+    if(r == &wbq.q[NWBQ])
+      break;
+    sleep(wbq.q, &wbq.lock);
+  }
+  release(&wbq.lock);
+}
+
+// Flusher kernel thread. Takes everything queued, writes it
+// one inode at a time, then drops the page and inode references.
+static void
+flusher(void)
+{
+  struct wbreq *r, *s;
+  struct wbctx c;
+
+  c.ip = 0;
+  for(;;){
+    acquire(&wbq.lock);
+    while(wbq.ready == 0)
+      sleep(&wbq, &wbq.lock);
+    for(r = wbq.q; r < &wbq.q[NWBQ]; r++)
+      if(r->ip && r->ip != WBRESERVED && !r->busy)
+        r->busy = 1;
+    wbq.ready = 0;
+    release(&wbq.lock);
+
+    // Group pages by inode to fill each transaction.
+    for(r = wbq.q; r < &wbq.q[NWBQ]; r++){
+      if(r->busy != 1)
+        continue;
+      for(s = r; s < &wbq.q[NWBQ]; s++){
+        if(s->busy == 1 && s->ip == r->ip){
+          wbput(&c, s->ip, s->page, s->off, s->n);
+          s->busy = 2;
+        }
+      }
+    }
+    wbend(&c);
+
+    for(r = wbq.q; r < &wbq.q[NWBQ]; r++){
+      if(!r->busy)
+        continue;
+      kfree(r->page);
+      begin_op();
+      iput(r->ip);
+      end_op();
+      acquire(&wbq.lock);
+      r->ip = 0;
+      r->busy = 0;
+      wbq.n--;
+      release(&wbq.lock);
+    }
+    wakeup(wbq.q);
+  }
+}
+
+// State of one syncer round, passed to wbcollect().
+struct wbround {
+  struct wbreq *slot[WBBATCH];  // Reserved slots
+  int nslot;                    // Number of reserved slots
+  int used;                     // Slots filled so far
+  int force;                    // Ignore the age of mappings
+};
+
+// Called by procscan() with ptable.lock held and p not running.
+// Queue aged dirty pages of p's shared file mappings into the
+// reserved slots. Returns 1 once all slots are filled.
+static int
+wbcollect(struct proc *p, void *arg)
+{
+  struct wbround *w = arg;
+  struct mmap_area *ma;
+  struct wbreq *r;
+  uint va;
+  pte_t *pte;
+  int n;
+
+  // Another thread of p may be running with these PTEs in its
+  // TLB, and no shootdown is possible with ptable.lock held.
+  // Leave such pages to msync() and munmap().
+  if(p->vm->cpus)
+    return 0;
+  for(ma = p->vm->mmaps; ma < &p->vm->mmaps[MAX_MMAPS_PROC]; ma++){
+    if(!ma->used || !ma->dirty || ma->file == 0)
+      continue;
+    if(!w->force && ticks - ma->dirtytick < WBAGE)
+      continue;
+    for(va = ma->addr; va < ma->addr + ma->length; va += PGSIZE){
+      if((pte = walkpgdir2(p->pgdir, (void*)va, 0)) == 0)
+        continue;
+      if(!(*pte & PTE_P) || !(*pte & PTE_D))
+        continue;
+      if(w->used == w->nslot)
+        return 1;
+      n = ma->addr + ma->length - va;
+      if(n > PGSIZE)
+        n = PGSIZE;
+      r = w->slot[w->used++];
+      r->page = P2V(PTE_ADDR(*pte));
+      kdup(r->page);
+      r->off = ma->offset + (va - ma->addr);
+      r->n = n;
+      r->busy = 0;
+      r->ip = idup(ma->file->ip);
+      *pte &= ~(PTE_W | PTE_D);
+    }
+    ma->dirty = 0;
+  }
+  return w->used == w->nslot;
+}
+
+// Syncer kernel thread. Every WBPERIOD ticks, or sooner when a
+// writer is throttled, queue up to WBBATCH pages of mappings that
+// have been dirty for WBAGE ticks, or of any dirty mapping if more
+// than WBBGDIRTY pages are dirty. The flusher writes them.
+static void
+syncer(void)
+{
+  struct wbround w;
+  struct wbreq *r;
+  uint t0;
+  int i;
+
+  for(;;){
+    acquire(&tickslock);
+    t0 = ticks;
+    do {
+      sleep(&ticks, &tickslock);
+    } while(ticks - t0 < WBPERIOD && !wbkick);
+    wbkick = 0;
+    release(&tickslock);
+
+    // Reserve slots first: wbq.lock can't be taken
+    // while procscan() holds ptable.lock.
+    w.nslot = 0;
+    w.used = 0;
+    acquire(&wbq.lock);
+    w.force = wbq.ndirty > WBBGDIRTY;
+    for(r = wbq.q; r < &wbq.q[NWBQ] && w.nslot < WBBATCH; r++){
+      if(r->ip == 0){
+        r->ip = WBRESERVED;
+        w.slot[w.nslot++] = r;
+        wbq.n++;
+      }
+    }
+    release(&wbq.lock);
+    if(w.nslot == 0)
+      continue;
+
+    procscan(wbcollect, &w, 0);
+
+    acquire(&wbq.lock);
+    for(i = w.used; i < w.nslot; i++){
+      w.slot[i]->ip = 0;
+      wbq.n--;
+    }
+    wbq.ready += w.used;
+    wbq.ndirty -= w.used;
+    if(wbq.ndirty < 0)
+      wbq.ndirty = 0;
+    wakeup(&wbq);
+    wakeup(wbq.q);
+    wakeup(&wbq.ndirty);
+    release(&wbq.lock);
+  }
+}
+
+void
+wbinit(void)
+{
+  initlock(&wbq.lock, "wbq");
+  if(kthread("flusher", flusher) < 0 || kthread("syncer", syncer) < 0)
+    panic("wbinit");
+}